@@ -0,0 +1,667 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   DSP building blocks shared by all plugins.
+
+   Everything here is `static inline`, so each plugin gets its own copy,
+   inlined in its processing loops.
+
+   The `run()` of each plugin checks its parameters once per block to dispatch
+   to the cheapest processing path giving the same result.  Every path
+   supports in-place processing, where input and output ports are connected to
+   the same buffer, and runs with denormals flushed to zero.
+
+   Plugins must define `_POSIX_C_SOURCE` to at least 200112L before including
+   any header, for `posix_memalign()`.
+*/
+
+#ifndef SIMPLE_LV2_DSP_H
+#define SIMPLE_LV2_DSP_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+/** Define a macro for converting a gain in dB to a coefficient. */
+#define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
+
+/** PI constant */
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif//M_PI
+
+/**
+   Processing kernels are marked with `DSP_KERNEL`.  With
+   `SIMPLE_LV2_MULTIVERSION` (`./waf configure --multiversion`), the compiler
+   builds an AVX2 and an AVX-512 variant of each kernel besides the default
+   one, and the best variant for the CPU is selected when the plugin library
+   is loaded.  Inline helpers called by a kernel are compiled in each variant.
+*/
+#if defined(SIMPLE_LV2_MULTIVERSION) && defined(__x86_64__) && \
+	defined(__GNUC__) && defined(__ELF__)
+#define DSP_KERNEL __attribute__((target_clones("default", "avx2", "avx512f")))
+#else
+#define DSP_KERNEL
+#endif
+
+/**
+   Make the FPU flush denormals to zero, and return its previous mode for
+   denormals_restore().  Decaying filter states, feedback and tails, or a
+   denormal input, would otherwise go through denormal arithmetic, about ten
+   times slower on x86.  run() sets this mode for its processing only, and
+   gives the host its own back.  Elsewhere, denormals are processed as usual.
+*/
+static inline uint64_t
+denormals_disable(void)
+{
+#if defined(__SSE__)
+	const unsigned int mode = _mm_getcsr();
+	_mm_setcsr(mode | 0x8040u); // flush to zero and denormals are zero
+	return mode;
+#elif defined(__aarch64__) && defined(__GNUC__)
+	uint64_t mode;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(mode));
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(mode | (1u << 24))); // FZ
+	return mode;
+#else
+	return 0;
+#endif
+}
+
+/** Restore the FPU `mode` returned by denormals_disable() */
+static inline void
+denormals_restore(uint64_t mode)
+{
+#if defined(__SSE__)
+	_mm_setcsr((unsigned int)mode);
+#elif defined(__aarch64__) && defined(__GNUC__)
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(mode));
+#else
+	(void)mode;
+#endif
+}
+
+/**
+   Return a control port value clamped to [`minimum`, `maximum`], the range
+   given in the plugin data, or `fallback` if it is NaN.  Hosts shouldn't send
+   such values, but one bad value mustn't make run() read outside of a buffer
+   or feed NaN to the processing.
+*/
+static inline float
+sanitize_control(float value, float minimum, float maximum, float fallback)
+{
+	if (isnan(value)) {
+		return fallback;
+	}
+	return value < minimum ? minimum : value > maximum ? maximum : value;
+}
+
+/**
+   Write `value` to an output control port.  Hosts that don't show an output
+   may leave it unconnected, it is skipped then.
+
+   Every plugin writes 0 to its `latency` port: output sample i depends on
+   input samples up to i only, there is no look-ahead to compensate for.
+*/
+static inline void
+write_control_output(float* port, float value)
+{
+	if (port) {
+		*port = value;
+	}
+}
+
+/**
+   Memory
+   ------
+
+   Instance data and delay buffers are aligned on a cache line.  Allocations
+   are also rounded up to a whole number of cache lines so aligned vector loads
+   at their end never touch another allocation.
+*/
+#define CACHE_LINE_SIZE 64
+
+/**
+   Allocate zeroed memory aligned on a cache line, with its size rounded up to
+   a multiple of the cache line size.  Memory must be released with
+   `aligned_free()`.
+*/
+static inline void*
+aligned_calloc(size_t size)
+{
+	void* ptr = NULL;
+	size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+#ifdef _WIN32
+	ptr = _aligned_malloc(size, CACHE_LINE_SIZE);
+#else
+	if (posix_memalign(&ptr, CACHE_LINE_SIZE, size)) {
+		ptr = NULL;
+	}
+#endif
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+/** Release memory obtained from `aligned_calloc()` */
+static inline void
+aligned_free(void* ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+/**
+   Set `*buffer` to a new zeroed buffer of `size` bytes to replace `current`,
+   of `current_size` bytes, or to NULL if `current` already has this size.
+   Nothing is freed, so an instance can allocate every buffer it needs before
+   replacing any, and stay unchanged if one allocation fails.  Return 0 if the
+   allocation failed.
+*/
+static inline int
+replacement_buffer(const void* current,
+                   size_t      current_size,
+                   size_t      size,
+                   void**      buffer)
+{
+	*buffer = NULL;
+	if (current && size == current_size) {
+		return 1;
+	}
+	*buffer = aligned_calloc(size);
+	return *buffer != NULL;
+}
+
+/**
+   Delay line
+   ----------
+
+   A delay line is a ring buffer of `delay_buffer_size` samples, written at
+   `write_head`.  A delay of `d` samples reads `d` samples behind the write
+   head.
+*/
+
+/** Return `head` moved forward by `n` samples, with `n` <= `size` */
+static inline unsigned int
+ring_advance(unsigned int head, unsigned int n, unsigned int size)
+{
+	head += n;
+	if (head >= size) {
+		head -= size;
+	}
+	return head;
+}
+
+/**
+   Copy `n_samples` of `input` into the delay line starting at `write_head`,
+   and return the new write head position.
+*/
+static inline unsigned int
+write_delay_line(float*       delay_buffer,
+                 unsigned int delay_buffer_size,
+                 unsigned int write_head,
+                 const float* input,
+                 uint32_t     n_samples)
+{
+	while (n_samples > 0) {
+		uint32_t chunk_size = delay_buffer_size - write_head;
+		if (chunk_size > n_samples) {
+			chunk_size = n_samples;
+		}
+		memcpy(delay_buffer + write_head, input, chunk_size * sizeof(float));
+		input += chunk_size;
+		n_samples -= chunk_size;
+		write_head = ring_advance(write_head, chunk_size, delay_buffer_size);
+	}
+	return write_head;
+}
+
+/**
+   Return non-zero if one of the `n_samples` of `buffer` is NaN or infinite,
+   i.e. has all exponent bits set.  The bit test is done 4 samples at a time
+   so the loop is vectorized even when the compiler doesn't unroll it.
+*/
+static inline int
+has_non_finite(const float* buffer, uint32_t n_samples)
+{
+	uint32_t found = 0;
+	uint32_t i = 0;
+	for (; i + 4 <= n_samples; i += 4) {
+		uint32_t bits[4];
+		memcpy(bits, buffer + i, sizeof(bits));
+		for (int k = 0; k < 4; k++) {
+			found |= (bits[k] & 0x7f800000u) == 0x7f800000u;
+		}
+	}
+	for (; i < n_samples; i++) {
+		uint32_t bits;
+		memcpy(&bits, buffer + i, sizeof(bits));
+		found |= (bits & 0x7f800000u) == 0x7f800000u;
+	}
+	return found != 0;
+}
+
+/**
+   Check the last `n_samples` written in the delay line, up to `write_head`.
+   A NaN or infinity written in a feedback loop would repeat forever: if one
+   is not finite, clear them all so it can't recirculate, and return non-zero,
+   so the caller silences the block.  The samples were just written, so they
+   are read from the cache, about 0.5 ns per sample.
+*/
+static inline int
+rescue_delay_line(float*       delay_buffer,
+                  unsigned int delay_buffer_size,
+                  unsigned int write_head,
+                  uint32_t     n_samples)
+{
+	if (n_samples > delay_buffer_size) {
+		n_samples = delay_buffer_size;
+	}
+	// Written region, as one or two contiguous parts
+	const unsigned int start = ring_advance(
+		write_head, delay_buffer_size - n_samples, delay_buffer_size);
+	const uint32_t first = start + n_samples > delay_buffer_size ?
+		delay_buffer_size - start : n_samples;
+	if (!has_non_finite(delay_buffer + start, first) &&
+	    !has_non_finite(delay_buffer, n_samples - first)) {
+		return 0;
+	}
+	memset(delay_buffer + start, 0, first * sizeof(float));
+	memset(delay_buffer, 0, (n_samples - first) * sizeof(float));
+	return 1;
+}
+
+/**
+   Read the delay line `delay_in_sample` samples behind `write_head`, with
+   linear interpolation between the two nearest samples.  The delay must be
+   positive and lower than `delay_buffer_size - 1`.
+*/
+static inline float
+read_delay_line(const float* delay_buffer,
+                unsigned int delay_buffer_size,
+                unsigned int write_head,
+                float        delay_in_sample)
+{
+	int delay_in_sample_i = (int)delay_in_sample; //integral part
+	float delay_in_sample_d = delay_in_sample -
+		(float)delay_in_sample_i; //decimal part
+
+	int read_head_a = write_head - delay_in_sample_i;
+	if (read_head_a < 0) read_head_a += delay_buffer_size;
+
+	int read_head_b = read_head_a - 1;
+	if (read_head_b < 0) read_head_b += delay_buffer_size;
+	//using interpolation to do subsampling delay
+	return (1.0f - delay_in_sample_d) * delay_buffer[read_head_a] +
+		delay_in_sample_d * delay_buffer[read_head_b];
+}
+
+/**
+   Compact delay line
+   ------------------
+
+   A compact delay line stores 16-bit samples, half the memory (and cache
+   footprint) of a float one.  Samples in [-`COMPACT_HEADROOM`,
+   `COMPACT_HEADROOM`] are stored, louder ones are clipped, which also bounds
+   a feedback loop.  Conversion adds TPDF dither, so the quantization error is
+   a noise uncorrelated with the signal instead of distortion.  It is added at
+   each repeat, and with feedback it ends up about 66 to 70 dB under the
+   repeats.  Conversion also makes the echo slower (about 7 ns per sample
+   instead of 3), so this only trades quality and speed for memory.
+*/
+typedef int16_t CompactSample;
+
+/** Highest stored magnitude, a power of 2 so decoding is exact */
+#define COMPACT_HEADROOM 4.0f
+
+/**
+   Return a triangular dither noise in [-1, 1] LSB for the sample number
+   `counter`.  The noise is a hash of the sample number rather than the next
+   value of a random generator, so a block of samples is converted without a
+   dependency between iterations and the loop can be vectorized.
+*/
+static inline float
+compact_dither(uint32_t counter)
+{
+	// Integer hash, the difference of its two halves is triangular
+	uint32_t noise = counter;
+	noise ^= noise >> 16;
+	noise *= 0x7feb352du;
+	noise ^= noise >> 15;
+	noise *= 0x846ca68bu;
+	noise ^= noise >> 16;
+	return (float)((int32_t)(noise & 0xffff) - (int32_t)(noise >> 16)) *
+		(1.0f / 65536.0f);
+}
+
+/**
+   Return `sample` as a compact sample, dithered with the noise of sample
+   number `counter`.  NaN is stored as 0, so a compact delay line only holds
+   finite values.
+*/
+static inline CompactSample
+compact_encode(float sample, uint32_t counter)
+{
+	float scaled = sample * (32768.0f / COMPACT_HEADROOM) +
+		compact_dither(counter);
+
+	// Clip the magnitude, compared as an integer: float comparisons may trap
+	// on NaN, so the compiler won't turn them into vector selects
+	uint32_t bits;
+	memcpy(&bits, &scaled, sizeof(bits));
+	uint32_t magnitude = bits & 0x7fffffffu;
+	magnitude = magnitude > 0x7f800000u ? 0u : magnitude; // NaN
+	magnitude = magnitude > 0x46fffe00u ? 0x46fffe00u : magnitude; // 32767
+	bits = (bits & 0x80000000u) | magnitude;
+	memcpy(&scaled, &bits, sizeof(scaled));
+
+	// Round to nearest, adding and removing 1.5 * 2^23 drops the fraction
+	// (unlike lrintf(), this can be vectorized)
+	scaled = (scaled + 12582912.0f) - 12582912.0f;
+	return (CompactSample)(int32_t)scaled;
+}
+
+/** Return the value of a compact sample */
+static inline float
+compact_decode(CompactSample sample)
+{
+	return (float)sample * (COMPACT_HEADROOM / 32768.0f);
+}
+
+/**
+   Like `write_delay_line()`, for a compact delay line.  `dither_counter` is
+   the number of the next sample for the dither, it is advanced by
+   `n_samples`.
+*/
+static inline unsigned int
+write_compact_delay_line(CompactSample* delay_buffer,
+                         unsigned int   delay_buffer_size,
+                         unsigned int   write_head,
+                         const float*   input,
+                         uint32_t       n_samples,
+                         uint32_t*      dither_counter)
+{
+	uint32_t counter = *dither_counter;
+	while (n_samples > 0) {
+		uint32_t chunk_size = delay_buffer_size - write_head;
+		if (chunk_size > n_samples) {
+			chunk_size = n_samples;
+		}
+		CompactSample* const chunk = delay_buffer + write_head;
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			chunk[i] = compact_encode(input[i], counter + i);
+		}
+		counter += chunk_size;
+		input += chunk_size;
+		n_samples -= chunk_size;
+		write_head = ring_advance(write_head, chunk_size, delay_buffer_size);
+	}
+	*dither_counter = counter;
+	return write_head;
+}
+
+/** Like `read_delay_line()`, for a compact delay line */
+static inline float
+read_compact_delay_line(const CompactSample* delay_buffer,
+                        unsigned int         delay_buffer_size,
+                        unsigned int         write_head,
+                        float                delay_in_sample)
+{
+	int delay_in_sample_i = (int)delay_in_sample; //integral part
+	float delay_in_sample_d = delay_in_sample -
+		(float)delay_in_sample_i; //decimal part
+
+	int read_head_a = write_head - delay_in_sample_i;
+	if (read_head_a < 0) read_head_a += delay_buffer_size;
+
+	int read_head_b = read_head_a - 1;
+	if (read_head_b < 0) read_head_b += delay_buffer_size;
+	return (1.0f - delay_in_sample_d) *
+		compact_decode(delay_buffer[read_head_a]) +
+		delay_in_sample_d * compact_decode(delay_buffer[read_head_b]);
+}
+
+/**
+   LFO
+   ---
+
+   An LFO phase (`progression`) is a 64-bit fixed-point fraction of a cycle,
+   moving forward by `delta`, the LFO frequency over the sampling rate, at each
+   sample.  Integer arithmetic wraps at the end of a cycle by itself, and the
+   phase never loses precision, so the LFO frequency is exact to a tiny
+   fraction of a hertz over renders of any length, and two instances with the
+   same settings stay in phase.  Values for a chunk are computed from the phase
+   at its start, so iterations are independent and the loop can be vectorized.
+*/
+/** Return the phase increment for an LFO at `frequency` */
+static inline uint64_t
+lfo_delta(float frequency, double rate)
+{
+	// Whole cycles per sample don't move the phase, and wouldn't fit
+	const double cycles = (double)frequency / rate;
+	return (uint64_t)((cycles - floor(cycles)) * 18446744073709551616.0);
+}
+
+/**
+   Return the value of a sine LFO, in [-1, 1], `i` samples after the phase
+   `progression`.  Within a chunk, the phase is computed with the 32 most
+   significant bits only, which is cheaper in vector code and off by a
+   negligible `i` / 2^32 of a cycle at most.
+*/
+static inline float
+lfo_value(uint64_t progression, uint64_t delta, uint32_t i)
+{
+	const uint32_t phase_bits =
+		(uint32_t)(progression >> 32) + i * (uint32_t)(delta >> 32);
+	// 24 bits, converted exactly to a float in [0, 1)
+	const float phase =
+		(float)(int32_t)(phase_bits >> 8) * (1.0f / 16777216.0f);
+	return sinf(2.0f * (float)M_PI * phase);
+}
+
+/** Return the LFO phase `n_samples` after `progression` */
+static inline uint64_t
+lfo_advance(uint64_t progression, uint64_t delta, uint32_t n_samples)
+{
+	return progression + (uint64_t)n_samples * delta;
+}
+
+/**
+   Return the phase, at sample `frame`, of an LFO started at sample 0.  The
+   product wraps like the phase itself, so it is exact for any frame, negative
+   ones included.
+*/
+static inline uint64_t
+lfo_phase_at(int64_t frame, uint64_t delta)
+{
+	return (uint64_t)frame * delta;
+}
+
+/** Return the phase of an offset given in degrees, in [0, 360] */
+static inline uint64_t
+lfo_offset(float degrees)
+{
+	const double cycle = (double)degrees / 360.0;
+	// A whole cycle (360 degrees) doesn't fit, and is no offset anyway
+	return cycle >= 1.0 ? 0 : (uint64_t)(cycle * 18446744073709551616.0);
+}
+
+/**
+   One-pole smoother
+   -----------------
+
+   `state` moves towards the input by a fraction `coef` at each sample.  This
+   is a one-pole low-pass filter, and `state - lowpass` a high-pass one.
+*/
+
+/** Return the coefficient for a cutoff frequency `cutoff` */
+static inline float
+onepole_coef(float cutoff, float rate)
+{
+	return 1.0f - expf(-2.0f * (float)M_PI * cutoff / rate);
+}
+
+/** Update `state` with `input` and return it */
+static inline float
+onepole_run(float* state, float coef, float input)
+{
+	*state += coef * (input - *state);
+	return *state;
+}
+
+/**
+   Envelope follower
+   -----------------
+
+   Peak level of a signal, rising with the attack coefficient and falling with
+   the release one.  The level is updated once every `ENVELOPE_STEP` samples,
+   from the peak of these samples: the peak search vectorizes, and only one
+   update per step is serial.  Callers ramp what they derive from the level
+   across the step, see `ramp_block()`.
+*/
+
+/** Number of samples between two updates of the level */
+#define ENVELOPE_STEP 8
+
+/** Return the coefficient for a time constant of `ms` milliseconds */
+static inline float
+envelope_coef(float ms, float rate)
+{
+	return 1.0f - expf(-1000.0f * ENVELOPE_STEP / (ms * rate));
+}
+
+/**
+   Return the coefficient `coef` of a full step, for a shorter step of
+   `n_samples` samples, so that the level moves as it would over as many
+   samples of full steps.
+*/
+static inline float
+envelope_step_coef(float coef, uint32_t n_samples)
+{
+	return 1.0f - powf(1.0f - coef, (float)n_samples / ENVELOPE_STEP);
+}
+
+/**
+   Return the largest magnitude of `n_samples` samples of `input`.  Infinity
+   and NaN count as the largest finite value, so the level stays finite.
+*/
+static inline float
+envelope_peak(const float* input, uint32_t n_samples)
+{
+	// Magnitudes compared as integers, like in compact_encode()
+	int32_t peak = 0;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		int32_t bits;
+		memcpy(&bits, input + i, sizeof(bits));
+		const int32_t magnitude = bits & 0x7fffffff;
+		peak = magnitude > peak ? magnitude : peak;
+	}
+	peak = peak > 0x7f7fffff ? 0x7f7fffff : peak; // FLT_MAX
+	float result;
+	memcpy(&result, &peak, sizeof(result));
+	return result;
+}
+
+/** Update the level `state` with the peak of a step and return it */
+static inline float
+envelope_run(float* state, float peak, float attack_coef, float release_coef)
+{
+	const float coef = peak > *state ? attack_coef : release_coef;
+	*state += coef * (peak - *state);
+	return *state;
+}
+
+/**
+   Ramps
+   -----
+*/
+
+/** Write a linear ramp from `from` (excluded) to `to` (included) */
+static inline void
+ramp_block(float* output, float from, float to, uint32_t n_samples)
+{
+	const float slope = (to - from) / (float)n_samples;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		output[i] = from + slope * (float)(i + 1);
+	}
+}
+
+/**
+   Mixer
+   -----
+
+   Block functions read each input sample before writing the output sample at
+   the same position, so `output` may be `input`.
+*/
+
+/** Dry/wet mix, attenuated by half so that a full mix can't clip */
+static inline float
+mix_dry_wet(float dry, float wet, float mix)
+{
+	return 0.5f * ((1.0f - mix) * dry + mix * wet);
+}
+
+/** Copy `input` to `output` unless they are the same buffer */
+static inline void
+copy_block(float* output, const float* input, uint32_t n_samples)
+{
+	if (output != input) {
+		memcpy(output, input, n_samples * sizeof(float));
+	}
+}
+
+/** Write `input` times `gain` to `output` */
+static inline void
+scale_block(float* output, const float* input, float gain, uint32_t n_samples)
+{
+	for (uint32_t pos = 0; pos < n_samples; pos++) {
+		output[pos] = gain * input[pos];
+	}
+}
+
+/**
+   Add `input` to a left and a right output, each with its own gain, in one
+   pass over the samples.  Outputs and input must not overlap: they are
+   restrict pointers, so the compiler vectorizes the loop without checking
+   for aliasing at run time.
+*/
+static inline void
+add_stereo_block(float* restrict       output_left,
+                 float* restrict       output_right,
+                 float                 gain_left,
+                 float                 gain_right,
+                 const float* restrict input,
+                 uint32_t              n_samples)
+{
+	for (uint32_t pos = 0; pos < n_samples; pos++) {
+		const float sample = input[pos];
+		output_left[pos] += gain_left * sample;
+		output_right[pos] += gain_right * sample;
+	}
+}
+
+#endif // SIMPLE_LV2_DSP_H
@@ -0,0 +1,142 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Extension data shared by all plugins.
+
+   The `extension_data()` function returns any extension data supported by the
+   plugin.  Note that this is not an instance method, but a function on the
+   plugin descriptor.  It is usually used by plugins to implement additional
+   interfaces.  All plugins provide the options interface (see `options.h`),
+   run() statistics when built with instrumentation (see `instrumentation.h`),
+   and the worker interface writing traces when built with tracing (see
+   `trace.h`).
+
+   These interfaces only differ by the instance type and the function adapting
+   an instance to new options, so `SIMPLE_LV2_EXTENSIONS(prefix, Type,
+   update)` defines them, with `prefix` prepended to the names of the
+   functions, and `prefix##extension_data()` for the plugin descriptor.  The
+   instance type embeds `InstanceOptions options`, and the `probe` and `trace`
+   members when built with instrumentation or tracing.
+
+   `extension_data()` is in the ``discovery'' threading class, so no other
+   functions or methods in this plugin library will be called concurrently
+   with it.
+*/
+
+#ifndef SIMPLE_LV2_EXTENSIONS_H
+#define SIMPLE_LV2_EXTENSIONS_H
+
+#include <string.h>
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#include "instrumentation.h"
+#include "options.h"
+#include "trace.h"
+
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+
+#define STATS_INTERFACE(prefix, Type) \
+	static int \
+	prefix##get_stats(LV2_Handle instance, SimpleLV2Stats* stats) \
+	{ \
+		return stats_read(&((Type*)instance)->probe, stats); \
+	}
+
+#define STATS_EXTENSION_DATA(prefix, uri) \
+	do { \
+		static const SimpleLV2StatsInterface stats = { prefix##get_stats }; \
+		if (!strcmp((uri), SIMPLE_LV2_STATS_URI)) { \
+			return &stats; \
+		} \
+	} while (0)
+
+#else
+
+#define STATS_INTERFACE(prefix, Type)
+#define STATS_EXTENSION_DATA(prefix, uri)
+
+#endif // SIMPLE_LV2_INSTRUMENTATION
+
+#ifdef SIMPLE_LV2_TRACING
+
+#define TRACE_INTERFACE(prefix, Type) \
+	static LV2_Worker_Status \
+	prefix##work(LV2_Handle                  instance, \
+	             LV2_Worker_Respond_Function respond, \
+	             LV2_Worker_Respond_Handle   handle, \
+	             uint32_t                    size, \
+	             const void*                 data) \
+	{ \
+		(void)respond; \
+		(void)handle; \
+		(void)size; \
+		(void)data; \
+		return trace_work(&((Type*)instance)->trace); \
+	}
+
+#define TRACE_EXTENSION_DATA(prefix, uri) \
+	do { \
+		static const LV2_Worker_Interface worker = { \
+			prefix##work, trace_work_response, NULL \
+		}; \
+		if (!strcmp((uri), LV2_WORKER__interface)) { \
+			return &worker; \
+		} \
+	} while (0)
+
+#else
+
+#define TRACE_INTERFACE(prefix, Type)
+#define TRACE_EXTENSION_DATA(prefix, uri)
+
+#endif // SIMPLE_LV2_TRACING
+
+#define SIMPLE_LV2_EXTENSIONS(prefix, Type, update) \
+	static uint32_t \
+	prefix##options_get(LV2_Handle instance, LV2_Options_Option* options) \
+	{ \
+		return get_instance_options(&((Type*)instance)->options, options); \
+	} \
+	\
+	static uint32_t \
+	prefix##options_set(LV2_Handle                instance, \
+	                    const LV2_Options_Option* options) \
+	{ \
+		return set_instance_options(&((Type*)instance)->options, instance, \
+		                            (update), options); \
+	} \
+	\
+	STATS_INTERFACE(prefix, Type) \
+	TRACE_INTERFACE(prefix, Type) \
+	\
+	static const void* \
+	prefix##extension_data(const char* uri) \
+	{ \
+		static const LV2_Options_Interface options = { \
+			prefix##options_get, prefix##options_set \
+		}; \
+		if (!strcmp(uri, LV2_OPTIONS__interface)) { \
+			return &options; \
+		} \
+		STATS_EXTENSION_DATA(prefix, uri); \
+		TRACE_EXTENSION_DATA(prefix, uri); \
+		return NULL; \
+	}
+
+#endif // SIMPLE_LV2_EXTENSIONS_H
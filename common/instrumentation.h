@@ -0,0 +1,164 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Optional run() instrumentation shared by all plugins.
+
+   When `SIMPLE_LV2_INSTRUMENTATION` is defined (`./waf configure
+   --instrumentation`), each instance records how many cycles and nanoseconds
+   its run() calls take, how many blocks went through each processing path,
+   and how many blocks had non-finite values cleared from a feedback
+   loop.  A host reads them with the interface returned by `extension_data()`
+   for `SIMPLE_LV2_STATS_URI`.
+
+   Only the audio thread writes the statistics, readers use a sequence counter
+   to get a consistent snapshot, so run() never blocks.  Instances embed a
+   `SimpleLV2Probe probe` member, and wrap run() with `STATS_BEGIN()` and
+   `STATS_END()`.  When the macro is not defined, these macros expand to
+   nothing and there is no overhead.
+*/
+
+#ifndef SIMPLE_LV2_INSTRUMENTATION_H
+#define SIMPLE_LV2_INSTRUMENTATION_H
+
+#define SIMPLE_LV2_STATS_URI \
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#stats"
+
+/** Maximum number of processing paths reported by a plugin */
+#define SIMPLE_LV2_STATS_MAX_PATHS 4
+
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_CYCLES() __rdtsc()
+#else
+#define STATS_CYCLES() 0
+#endif
+
+/** Statistics of an instance, as seen by a reader */
+typedef struct {
+	uint64_t runs;              // number of run() calls
+	uint64_t samples;           // number of processed samples
+	uint64_t cycles;            // CPU cycles spent in run(), 0 if unknown
+	uint64_t ns;                // nanoseconds spent in run()
+	uint64_t last_cycles;       // CPU cycles spent in the last run()
+	float    min_ns_per_sample; // best run() cost per sample
+	float    max_ns_per_sample; // worst run() cost per sample
+	uint64_t path_count[SIMPLE_LV2_STATS_MAX_PATHS]; // blocks per path
+	uint64_t rescues;           // blocks with non-finite values cleared
+} SimpleLV2Stats;
+
+/**
+   Interface returned by `extension_data()`.  `get_stats()` may be called from
+   any thread while the instance runs, it returns 0 on success and non-zero if
+   no consistent snapshot could be taken (it can be retried).
+*/
+typedef struct {
+	int (*get_stats)(LV2_Handle instance, SimpleLV2Stats* stats);
+} SimpleLV2StatsInterface;
+
+/** Instrumentation data embedded in an instance */
+typedef struct {
+	uint32_t       sequence; // odd while the audio thread updates stats
+	SimpleLV2Stats stats;
+	uint64_t       start_cycles;
+	uint64_t       start_ns;
+} SimpleLV2Probe;
+
+static inline uint64_t
+stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void
+stats_begin(SimpleLV2Probe* probe)
+{
+	probe->start_ns = stats_now_ns();
+	probe->start_cycles = STATS_CYCLES();
+}
+
+static inline void
+stats_end(SimpleLV2Probe*  probe,
+          uint32_t         n_samples,
+          const uint32_t*  path_count,
+          unsigned int     n_paths,
+          uint32_t         rescues)
+{
+	const uint64_t cycles = STATS_CYCLES() - probe->start_cycles;
+	const uint64_t ns = stats_now_ns() - probe->start_ns;
+	SimpleLV2Stats* const stats = &probe->stats;
+
+	__atomic_store_n(&probe->sequence, probe->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	stats->runs++;
+	stats->samples += n_samples;
+	stats->cycles += cycles;
+	stats->ns += ns;
+	stats->last_cycles = cycles;
+	if (n_samples > 0) {
+		const float ns_per_sample = (float)ns / (float)n_samples;
+		if (stats->runs == 1 || ns_per_sample < stats->min_ns_per_sample) {
+			stats->min_ns_per_sample = ns_per_sample;
+		}
+		if (ns_per_sample > stats->max_ns_per_sample) {
+			stats->max_ns_per_sample = ns_per_sample;
+		}
+	}
+	for (unsigned int i = 0; i < n_paths; i++) {
+		stats->path_count[i] = path_count[i];
+	}
+	stats->rescues = rescues;
+	__atomic_store_n(&probe->sequence, probe->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline int
+stats_read(const SimpleLV2Probe* probe, SimpleLV2Stats* stats)
+{
+	for (int attempt = 0; attempt < 64; attempt++) {
+		const uint32_t before =
+			__atomic_load_n(&probe->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			continue;
+		}
+		*stats = probe->stats;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&probe->sequence, __ATOMIC_RELAXED) == before) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#define STATS_BEGIN(inst) stats_begin(&(inst)->probe)
+#define STATS_END(inst, n_samples, counts, n, rescues) \
+	stats_end(&(inst)->probe, (n_samples), (counts), (n), (rescues))
+
+#else
+
+#define STATS_BEGIN(inst)
+#define STATS_END(inst, n_samples, counts, n, rescues)
+
+#endif // SIMPLE_LV2_INSTRUMENTATION
+
+#endif // SIMPLE_LV2_INSTRUMENTATION_H
@@ -0,0 +1,196 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   LFO phase offset and synchronisation to the host transport, shared by the
+   plugins with an LFO.
+
+   These plugins have a phase offset control, a sync toggle, and an optional
+   atom input port receiving the `time:Position` objects of the host.  When
+   sync is on and the transport is rolling, the LFO phase at the start of each
+   block is computed from the transport frame, as `frame * delta`, instead of
+   being carried over from the previous block.  With integer LFO phases this is
+   exact, so all instances with the same rate and phase offset are in phase,
+   whenever they were instantiated or activated.  Within the block, the LFO
+   moves at the transport speed, so at speeds other than 1 it reaches the
+   phase of the next block start without a jump.
+
+   A position received during a block applies to the current block: its frame
+   is moved back to the block start by the event time.  While the transport is
+   stopped, or if the host sends no position, the LFO runs freely from where
+   it is.
+*/
+
+#ifndef SIMPLE_LV2_LFO_SYNC_H
+#define SIMPLE_LV2_LFO_SYNC_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+
+#include "dsp.h"
+
+/** Fastest transport speed followed, positions with faster ones are ignored */
+#define LFO_SYNC_MAX_SPEED 1000.0f
+
+/** URIDs needed to read positions, 0 when the host can't map them */
+typedef struct {
+	LV2_URID atom_Blank;
+	LV2_URID atom_Float;
+	LV2_URID atom_Long;
+	LV2_URID atom_Object;
+	LV2_URID time_Position;
+	LV2_URID time_frame;
+	LV2_URID time_speed;
+} LfoSyncURIDs;
+
+/** Transport state and phase offset, embedded in an instance */
+typedef struct {
+	int64_t  frame;    // transport frame at the start of the next block
+	double   fraction; // and fraction of a frame, in [0, 1)
+	float    speed;    // transport speed, 0 when stopped
+	int      valid;  // set once a position has been received
+	uint64_t offset; // phase offset applied to the LFO
+} LfoSync;
+
+static inline void
+map_lfo_sync_urids(const LV2_URID_Map* map, LfoSyncURIDs* urids)
+{
+	urids->atom_Blank    = map->map(map->handle, LV2_ATOM__Blank);
+	urids->atom_Float    = map->map(map->handle, LV2_ATOM__Float);
+	urids->atom_Long     = map->map(map->handle, LV2_ATOM__Long);
+	urids->atom_Object   = map->map(map->handle, LV2_ATOM__Object);
+	urids->time_Position = map->map(map->handle, LV2_TIME__Position);
+	urids->time_frame    = map->map(map->handle, LV2_TIME__frame);
+	urids->time_speed    = map->map(map->handle, LV2_TIME__speed);
+}
+
+/** Forget the transport state and the phase offset, in `reset()` */
+static inline void
+lfo_sync_reset(LfoSync* sync)
+{
+	memset(sync, 0, sizeof(*sync));
+}
+
+/** Move the transport position by `frames`, which may be fractional */
+static inline void
+lfo_sync_move(LfoSync* sync, double frames)
+{
+	const double moved = sync->fraction + frames;
+	const double whole = floor(moved);
+	sync->fraction = moved - whole;
+	// Frames wrap around like LFO phases, so the arithmetic is unsigned
+	sync->frame = (int64_t)((uint64_t)sync->frame + (uint64_t)(int64_t)whole);
+}
+
+/** Read the positions of the `control` port, which may be NULL */
+static inline void
+lfo_sync_read(LfoSync*                 sync,
+              const LfoSyncURIDs*      urids,
+              const LV2_Atom_Sequence* control)
+{
+	if (!control || !urids->time_Position) {
+		return;
+	}
+	LV2_ATOM_SEQUENCE_FOREACH(control, ev) {
+		if (ev->body.type != urids->atom_Object &&
+		    ev->body.type != urids->atom_Blank) {
+			continue;
+		}
+		const LV2_Atom_Object* object = (const LV2_Atom_Object*)&ev->body;
+		if (object->body.otype != urids->time_Position) {
+			continue;
+		}
+		const LV2_Atom* frame = NULL;
+		const LV2_Atom* speed = NULL;
+		lv2_atom_object_get(object,
+		                    urids->time_frame, &frame,
+		                    urids->time_speed, &speed,
+		                    0);
+		if (speed && speed->type == urids->atom_Float) {
+			// Not finite or absurd speeds would overflow frame offsets
+			const float value = ((const LV2_Atom_Float*)speed)->body;
+			if (fabsf(value) <= LFO_SYNC_MAX_SPEED) {
+				sync->speed = value;
+			}
+		}
+		if (frame && frame->type == urids->atom_Long) {
+			// Position of the block start, the event may come later
+			sync->frame = ((const LV2_Atom_Long*)frame)->body;
+			sync->fraction = 0.0;
+			lfo_sync_move(sync, -(double)sync->speed * (double)ev->time.frames);
+			sync->valid = 1;
+		}
+	}
+}
+
+/** Return the phase increment `delta` scaled by the transport `speed` */
+static inline uint64_t
+lfo_sync_delta(uint64_t delta, float speed)
+{
+	if (speed == 1.0f) {
+		return delta;
+	}
+	// Whole cycles per sample don't move the phase, as in lfo_delta()
+	const double cycles = (double)delta / 18446744073709551616.0 * speed;
+	const double fraction = cycles - floor(cycles);
+	return fraction < 1.0 ? (uint64_t)(fraction * 18446744073709551616.0) : 0;
+}
+
+/**
+   Read the positions of the `control` port, and return the LFO phase at the
+   start of the block: derived from the transport if `enabled` and the
+   transport is rolling, else `progression`.  Either way, it is moved by a
+   change of the phase offset `offset_degrees`.  When derived from the
+   transport, the phase increment `delta` is scaled by the transport speed.
+*/
+static inline uint64_t
+lfo_sync_phase(LfoSync*                 sync,
+               const LfoSyncURIDs*      urids,
+               const LV2_Atom_Sequence* control,
+               int                      enabled,
+               float                    offset_degrees,
+               uint64_t                 progression,
+               uint64_t*                delta)
+{
+	lfo_sync_read(sync, urids, control);
+
+	const uint64_t offset = lfo_offset(offset_degrees);
+	if (enabled && sync->valid && sync->speed != 0.0f) {
+		progression = lfo_phase_at(sync->frame, *delta) +
+			(uint64_t)(sync->fraction * (double)*delta) + offset;
+		*delta = lfo_sync_delta(*delta, sync->speed);
+	} else {
+		progression += offset - sync->offset;
+	}
+	sync->offset = offset;
+	return progression;
+}
+
+/** Move the transport position to the start of the next block */
+static inline void
+lfo_sync_advance(LfoSync* sync, uint32_t n_samples)
+{
+	lfo_sync_move(sync, (double)sync->speed * (double)n_samples);
+}
+
+#endif // SIMPLE_LV2_LFO_SYNC_H
@@ -0,0 +1,285 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Host features and LV2 options shared by all plugins.
+
+   Plugins support the options interface, so a host can change the sampling
+   rate (`param:sampleRate`) and the maximum or nominal block length
+   (`bufsz:maxBlockLength`, `bufsz:nominalBlockLength`) of an instance without
+   re-instantiating it.  Each instance embeds an `InstanceOptions`, and gives
+   the functions below its own `UpdateOptionsFunction`, which adapts the
+   instance to new options.
+
+   Delay buffers are allocated for the sampling rate, so a rate change
+   reallocates them, recomputes rate-derived constants and clears the
+   processing state.  Block lengths size the scratch buffers used for block
+   processing.  When the host gives no bound, or a very large one, run()
+   processes its block in chunks of the scratch buffer length.
+*/
+
+#ifndef SIMPLE_LV2_OPTIONS_H
+#define SIMPLE_LV2_OPTIONS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/parameters/parameters.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+/** Lowest and highest supported sampling rates */
+#define MIN_SAMPLE_RATE 1.0
+#define MAX_SAMPLE_RATE 768000.0
+
+/** Scratch buffer length when the host gives no block length */
+#define DEFAULT_SCRATCH_LENGTH 256
+
+/** Longest scratch buffer, longer blocks are processed in chunks */
+#define MAX_SCRATCH_LENGTH 8192
+
+/** URIDs needed to read and write options, 0 when the host can't map them */
+typedef struct {
+	LV2_URID atom_Double;
+	LV2_URID atom_Float;
+	LV2_URID atom_Int;
+	LV2_URID atom_Long;
+	LV2_URID bufsz_maxBlockLength;
+	LV2_URID bufsz_nominalBlockLength;
+	LV2_URID param_sampleRate;
+} OptionURIDs;
+
+/** Options of an instance, as last applied */
+typedef struct {
+	OptionURIDs urids;
+	double      rate;
+	int32_t     max_block_length;     // 0 if unknown
+	int32_t     nominal_block_length; // 0 if unknown
+} InstanceOptions;
+
+/**
+   Adapt `instance` to `options`, which differ from its current options by at
+   most one value, except on instantiation.  On failure, the instance must be
+   left as it was.  Return an `LV2_Options_Status`.
+*/
+typedef uint32_t (*UpdateOptionsFunction)(LV2_Handle             instance,
+                                          const InstanceOptions* options);
+
+/** Return the data of the host feature `uri`, or NULL if not provided */
+static inline void*
+get_feature(const LV2_Feature* const* features, const char* uri)
+{
+	for (int i = 0; features && features[i]; i++) {
+		if (!strcmp(features[i]->URI, uri)) {
+			return features[i]->data;
+		}
+	}
+	return NULL;
+}
+
+static inline void
+map_option_urids(const LV2_URID_Map* map, OptionURIDs* urids)
+{
+	urids->atom_Double          = map->map(map->handle, LV2_ATOM__Double);
+	urids->atom_Float           = map->map(map->handle, LV2_ATOM__Float);
+	urids->atom_Int             = map->map(map->handle, LV2_ATOM__Int);
+	urids->atom_Long            = map->map(map->handle, LV2_ATOM__Long);
+	urids->bufsz_maxBlockLength =
+		map->map(map->handle, LV2_BUF_SIZE__maxBlockLength);
+	urids->bufsz_nominalBlockLength =
+		map->map(map->handle, LV2_BUF_SIZE__nominalBlockLength);
+	urids->param_sampleRate = map->map(map->handle, LV2_PARAMETERS__sampleRate);
+}
+
+/**
+   Read the value of a numeric option into `value`.  Return 0 if the option
+   value isn't a number.
+*/
+static inline int
+get_option_number(const OptionURIDs*        urids,
+                  const LV2_Options_Option* option,
+                  double*                   value)
+{
+	if (option->type == 0 || !option->value) {
+		return 0;
+	} else if (option->type == urids->atom_Double &&
+	           option->size == sizeof(double)) {
+		*value = *(const double*)option->value;
+	} else if (option->type == urids->atom_Float &&
+	           option->size == sizeof(float)) {
+		*value = *(const float*)option->value;
+	} else if (option->type == urids->atom_Int &&
+	           option->size == sizeof(int32_t)) {
+		*value = *(const int32_t*)option->value;
+	} else if (option->type == urids->atom_Long &&
+	           option->size == sizeof(int64_t)) {
+		*value = (double)*(const int64_t*)option->value;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/**
+   Set the value of `option` in `options`.  Values that aren't finite or are
+   out of range are rejected, so casts to integers are always defined.
+   Return an `LV2_Options_Status`.
+*/
+static inline uint32_t
+parse_option(InstanceOptions* options, const LV2_Options_Option* option)
+{
+	const OptionURIDs* urids = &options->urids;
+	double value;
+
+	if (option->context != LV2_OPTIONS_INSTANCE) {
+		return LV2_OPTIONS_ERR_BAD_SUBJECT;
+	} else if (option->key != urids->param_sampleRate &&
+	           option->key != urids->bufsz_maxBlockLength &&
+	           option->key != urids->bufsz_nominalBlockLength) {
+		return LV2_OPTIONS_ERR_BAD_KEY;
+	} else if (!get_option_number(urids, option, &value)) {
+		return LV2_OPTIONS_ERR_BAD_VALUE;
+	}
+
+	// Comparisons with NaN are false, so it is rejected too
+	if (option->key == urids->param_sampleRate) {
+		if (!(value >= MIN_SAMPLE_RATE && value <= MAX_SAMPLE_RATE)) {
+			return LV2_OPTIONS_ERR_BAD_VALUE;
+		}
+		options->rate = value;
+	} else if (!(value >= 0.0 && value <= INT32_MAX)) {
+		return LV2_OPTIONS_ERR_BAD_VALUE;
+	} else if (option->key == urids->bufsz_maxBlockLength) {
+		options->max_block_length = (int32_t)value;
+	} else {
+		options->nominal_block_length = (int32_t)value;
+	}
+	return LV2_OPTIONS_SUCCESS;
+}
+
+/**
+   Set up the options of a new instance, from the sampling rate given to
+   `instantiate()` and the options of the host, and `update` the instance
+   with them.  Invalid host options are ignored.  Return 0 if the instance
+   can't run with them.
+*/
+static inline int
+init_instance_options(InstanceOptions*          options,
+                      LV2_Handle                instance,
+                      UpdateOptionsFunction     update,
+                      double                    rate,
+                      const LV2_Feature* const* features)
+{
+	const LV2_URID_Map* map =
+		(const LV2_URID_Map*)get_feature(features, LV2_URID__map);
+	const LV2_Options_Option* host_options =
+		(const LV2_Options_Option*)get_feature(features, LV2_OPTIONS__options);
+	InstanceOptions initial;
+
+	memset(&initial, 0, sizeof(initial));
+	initial.rate = rate;
+	if (map) {
+		map_option_urids(map, &initial.urids);
+		for (int i = 0; host_options && host_options[i].key; i++) {
+			parse_option(&initial, &host_options[i]);
+		}
+	}
+	if (!(initial.rate >= MIN_SAMPLE_RATE && initial.rate <= MAX_SAMPLE_RATE) ||
+	    update(instance, &initial) != LV2_OPTIONS_SUCCESS) {
+		return 0;
+	}
+	*options = initial;
+	return 1;
+}
+
+/** Get instance options, see `LV2_Options_Interface` */
+static inline uint32_t
+get_instance_options(InstanceOptions* options, LV2_Options_Option* requested)
+{
+	const OptionURIDs* urids = &options->urids;
+	uint32_t status = LV2_OPTIONS_SUCCESS;
+
+	for (LV2_Options_Option* option = requested; option->key; option++) {
+		if (option->context != LV2_OPTIONS_INSTANCE) {
+			status |= LV2_OPTIONS_ERR_BAD_SUBJECT;
+		} else if (option->key == urids->param_sampleRate) {
+			option->size = sizeof(double);
+			option->type = urids->atom_Double;
+			option->value = &options->rate;
+		} else if (option->key == urids->bufsz_maxBlockLength &&
+		           options->max_block_length > 0) {
+			option->size = sizeof(int32_t);
+			option->type = urids->atom_Int;
+			option->value = &options->max_block_length;
+		} else if (option->key == urids->bufsz_nominalBlockLength &&
+		           options->nominal_block_length > 0) {
+			option->size = sizeof(int32_t);
+			option->type = urids->atom_Int;
+			option->value = &options->nominal_block_length;
+		} else {
+			status |= LV2_OPTIONS_ERR_BAD_KEY;
+		}
+	}
+	return status;
+}
+
+/**
+   Set instance options one after the other, see `LV2_Options_Interface`.
+   Each valid option is applied with `update`, and kept if it succeeds.
+*/
+static inline uint32_t
+set_instance_options(InstanceOptions*          options,
+                     LV2_Handle                instance,
+                     UpdateOptionsFunction     update,
+                     const LV2_Options_Option* changes)
+{
+	uint32_t status = LV2_OPTIONS_SUCCESS;
+
+	for (const LV2_Options_Option* option = changes; option->key; option++) {
+		InstanceOptions changed = *options;
+		uint32_t option_status = parse_option(&changed, option);
+		if (option_status == LV2_OPTIONS_SUCCESS) {
+			option_status = update(instance, &changed);
+		}
+		if (option_status == LV2_OPTIONS_SUCCESS) {
+			*options = changed;
+		}
+		status |= option_status;
+	}
+	return status;
+}
+
+/**
+   Return the scratch buffer length for the given maximum and nominal block
+   lengths, 0 meaning unknown.
+*/
+static inline uint32_t
+get_scratch_length(int32_t max_block_length, int32_t nominal_block_length)
+{
+	int32_t length = DEFAULT_SCRATCH_LENGTH;
+	if (max_block_length > 0) {
+		length = max_block_length;
+	} else if (nominal_block_length > 0) {
+		length = nominal_block_length;
+	}
+	return length < MAX_SCRATCH_LENGTH ? length : MAX_SCRATCH_LENGTH;
+}
+
+#endif // SIMPLE_LV2_OPTIONS_H
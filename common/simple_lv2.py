@@ -0,0 +1,177 @@
+#!/usr/bin/env python
+"""
+Waf tool with the configure options shared by all plugins: optional
+instrumentation and tracing, the build profiles (LTO, target architecture,
+kernel multiversioning, profile-guided optimization), the tests and the
+`bench` command, which builds the plugins and benchmarks them.
+
+Each plugin wscript loads it from its `options()`, calls
+`conf.configure_simple_lv2()` from its `configure()`, and
+`bld.simple_lv2_tests()` and `bld.simple_lv2_bench()` from its `build()`:
+
+    opt.load('simple_lv2',
+             tooldir=opt.path.parent.find_dir('common').abspath())
+"""
+
+import os
+
+from waflib.Build import BuildContext
+from waflib.Configure import conf
+from waflib.Tools import waf_unit_test
+from waflib.extras import autowaf as autowaf
+
+# Compiler flags of --sanitize builds
+SANITIZE_FLAGS = ['-fsanitize=address,undefined,float-cast-overflow',
+                  '-fno-sanitize-recover=all', '-fno-omit-frame-pointer']
+
+
+class BenchContext(BuildContext):
+    '''build the plugins, then benchmark them with tests/bench.c'''
+    cmd = 'bench'
+    fun = 'build'
+
+
+def options(opt):
+    opt.add_option('--instrumentation', action='store_true', default=False,
+                   dest='instrumentation',
+                   help='Record run() statistics readable by the host')
+    opt.add_option('--tracing', action='store_true', default=False,
+                   dest='tracing',
+                   help='Write per-block run() timing traces')
+    opt.add_option('--lto', action='store_true', default=False, dest='lto',
+                   help='Build with link-time optimization')
+    opt.add_option('--arch', type='string', default=None, dest='arch',
+                   help='Target architecture for -march, e.g. x86-64-v3')
+    opt.add_option('--multiversion', action='store_true', default=False,
+                   dest='multiversion',
+                   help='Build AVX2 and AVX-512 variants of processing '
+                   'kernels, selected at load time')
+    opt.add_option('--pgo-generate', type='string', default=None,
+                   dest='pgo_generate', metavar='DIR',
+                   help='Build for profile generation, profiles go to DIR '
+                   'when running ./waf bench')
+    opt.add_option('--pgo-use', type='string', default=None,
+                   dest='pgo_use', metavar='DIR',
+                   help='Optimize using the profiles in DIR')
+    opt.add_option('--test', action='store_true', default=False,
+                   dest='build_tests',
+                   help='Build the tests in ../tests and run them')
+    opt.add_option('--sanitize', action='store_true', default=False,
+                   dest='sanitize',
+                   help='Build the tests with AddressSanitizer and '
+                   'UndefinedBehaviorSanitizer')
+    opt.add_option('--scaling', action='store_true', default=False,
+                   dest='bench_scaling',
+                   help='With bench, also run 1 to 1000 instances in turn '
+                   'and report their cost and memory')
+    opt.add_option('--kernels', action='store_true', default=False,
+                   dest='bench_kernels',
+                   help='With bench, also time the modulated delay of the '
+                   'chorus and flanger in two passes and in a single loop')
+    opt.load('waf_unit_test')
+
+
+@conf
+def configure_simple_lv2(conf):
+    """Apply the shared options, on top of the autowaf release or debug
+    flags"""
+    if conf.options.instrumentation:
+        conf.env.append_value('CFLAGS', ['-DSIMPLE_LV2_INSTRUMENTATION'])
+    autowaf.display_msg(conf, 'Instrumentation',
+                        bool(conf.options.instrumentation))
+
+    conf.env.SIMPLE_LV2_TRACING = bool(conf.options.tracing)
+    if conf.options.tracing:
+        conf.env.append_value('CFLAGS', ['-DSIMPLE_LV2_TRACING'])
+    autowaf.display_msg(conf, 'Tracing', bool(conf.options.tracing))
+
+    if conf.options.lto:
+        conf.env.append_value('CFLAGS', ['-flto'])
+        conf.env.append_value('LINKFLAGS', ['-flto'])
+    if conf.options.arch:
+        conf.env.append_value('CFLAGS', ['-march=' + conf.options.arch])
+    if conf.options.multiversion:
+        conf.env.append_value('CFLAGS', ['-DSIMPLE_LV2_MULTIVERSION'])
+    # GCC value profiling uses thread-local storage, which the resolvers of
+    # multiversioned kernels would touch before it is set up when the plugin
+    # is loaded, so it is left out of both the profiles and their use
+    value_flags = []
+    if conf.options.multiversion and conf.env.CC_NAME == 'gcc':
+        value_flags = ['-fno-profile-values']
+    if conf.options.pgo_generate and conf.options.pgo_use:
+        conf.fatal('--pgo-generate and --pgo-use are exclusive')
+    elif conf.options.pgo_generate:
+        flags = ['-fprofile-generate=' +
+                 os.path.abspath(conf.options.pgo_generate)] + value_flags
+        conf.env.append_value('CFLAGS', flags)
+        conf.env.append_value('LINKFLAGS', flags)
+    elif conf.options.pgo_use:
+        flags = ['-fprofile-use=' + os.path.abspath(conf.options.pgo_use),
+                 '-fprofile-correction'] + value_flags
+        conf.env.append_value('CFLAGS', flags)
+        conf.env.append_value('LINKFLAGS', flags)
+    autowaf.display_msg(conf, 'Link-time optimization', bool(conf.options.lto))
+    autowaf.display_msg(conf, 'Target architecture',
+                        conf.options.arch or 'default')
+    autowaf.display_msg(conf, 'Kernel multiversioning',
+                        bool(conf.options.multiversion))
+    autowaf.display_msg(conf, 'Profile-guided optimization',
+                        'generate' if conf.options.pgo_generate else
+                        'use' if conf.options.pgo_use else False)
+
+    conf.env.SIMPLE_LV2_TESTS = bool(conf.options.build_tests)
+    if conf.options.build_tests:
+        conf.load('waf_unit_test')
+    if conf.options.sanitize:
+        conf.env.CFLAGS_SANITIZE = SANITIZE_FLAGS
+        conf.env.LINKFLAGS_SANITIZE = SANITIZE_FLAGS
+    autowaf.display_msg(conf, 'Tests', bool(conf.options.build_tests))
+    autowaf.display_msg(conf, 'Sanitizers', bool(conf.options.sanitize))
+
+    # The benchmark loads the plugin binary
+    conf.check(lib='dl', uselib_store='DL', mandatory=False)
+
+
+@conf
+def simple_lv2_tests(bld, plugin, includes):
+    """Build and run the tests of `plugin`, tests/*_<plugin>.c, and the tests
+    of the shared DSP code, tests/test_dsp.c, if enabled.  Plugin tests
+    include the plugin source, so they are rebuilt and run again whenever the
+    plugin changes."""
+    if not bld.env.SIMPLE_LV2_TESTS:
+        return
+    tests = bld.path.parent.find_dir('tests')
+    for source in tests.ant_glob('*_%s.c test_dsp.c' % plugin):
+        bld(features     = 'c cprogram test',
+            source       = source,
+            target       = 'tests/' + source.name[:-2],
+            install_path = None,
+            uselib       = 'M LV2 SANITIZE',
+            includes     = includes)
+    bld.add_post_fun(waf_unit_test.summary)
+    bld.add_post_fun(waf_unit_test.set_exit_code)
+
+
+@conf
+def simple_lv2_bench(bld, plugin, includes):
+    """With `./waf bench`, build tests/bench.c, and run it on the binary of
+    `plugin`, the name of its task generator, once the build is done."""
+    if bld.cmd != 'bench':
+        return
+    tests = bld.path.parent.find_dir('tests')
+    bld(features     = 'c cprogram',
+        source       = tests.find_node('bench.c'),
+        target       = 'tests/bench',
+        name         = 'bench',
+        install_path = None,
+        uselib       = 'M LV2 DL',
+        includes     = includes)
+
+    def run(bld):
+        binary = bld.get_tgen_by_name(plugin).link_task.outputs[0]
+        bench = bld.get_tgen_by_name('bench').link_task.outputs[0]
+        flags = ['-s'] if bld.options.bench_scaling else []
+        flags += ['-k'] if bld.options.bench_kernels else []
+        if bld.exec_command([bench.abspath()] + flags + [binary.abspath()]):
+            bld.fatal('Benchmark of %s failed' % binary.name)
+    bld.add_post_fun(run)
@@ -0,0 +1,247 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Optional per-block run() tracing shared by all plugins.
+
+   When `SIMPLE_LV2_TRACING` is defined (`./waf configure --tracing`), each
+   instance records the start time, duration and length of every block it
+   processes, and writes them to a Chrome trace-event file, which can be
+   opened in chrome://tracing or Perfetto to find the blocks that were late.
+
+   The audio thread only stores events in a per-instance ring and, when the
+   ring fills up, asks the host to run the worker (LV2 worker extension).  The
+   worker, in a non real-time thread, drains the ring and writes the file.
+   run() never blocks nor allocates; if the worker can't keep up, events are
+   dropped and their number is written to the trace.  Without the
+   `worker:schedule` feature, events are only written when the instance is
+   destroyed, so at most one ring of events is kept.
+
+   Files are written in the `SIMPLE_LV2_TRACE_DIR` directory (default: current
+   directory), named after the plugin, the host process id and the number of
+   the instance in the process, e.g. `simple-echo-1234-1.json`.  Instances are
+   numbered with a process-wide counter rather than from their address, so an
+   instance allocated where a destroyed one was doesn't overwrite its trace.
+
+   Instances embed a `SimpleLV2Trace trace` member, and wrap run() with
+   `TRACE_BEGIN()` and `TRACE_END()`.  When the macro is not defined, these
+   macros expand to nothing and there is no overhead.
+*/
+
+#ifndef SIMPLE_LV2_TRACE_H
+#define SIMPLE_LV2_TRACE_H
+
+#ifdef SIMPLE_LV2_TRACING
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+/** Number of events in a ring, a power of 2 */
+#define TRACE_RING_SIZE 1024
+
+/** Fill level at which the audio thread schedules a flush */
+#define TRACE_FLUSH_LEVEL (TRACE_RING_SIZE / 4)
+
+/** A processed block */
+typedef struct {
+	uint64_t start_ns;    // run() start, monotonic clock
+	uint32_t duration_ns; // run() duration
+	uint32_t n_samples;   // block length
+} SimpleLV2TraceEvent;
+
+/** Tracing data embedded in an instance */
+typedef struct {
+	SimpleLV2TraceEvent events[TRACE_RING_SIZE];
+	uint32_t write_index;   // written by the audio thread only
+	uint32_t read_index;    // written by the worker only
+	uint32_t dropped;       // events lost, written by the audio thread only
+	uint32_t flush_pending; // set by the audio thread, cleared by the worker
+	uint64_t start_ns;
+	const LV2_Worker_Schedule* schedule; // NULL if not provided by the host
+	// Worker only
+	FILE*       file;
+	uint32_t    written_dropped;
+	uint32_t    id;  // number of the instance in the process
+	int         pid; // host process id
+	const char* plugin;
+	char        path[256];
+} SimpleLV2Trace;
+
+/** Number of the last instance traced in the process */
+static uint32_t trace_instances = 0;
+
+static inline uint64_t
+trace_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/** Initialise tracing of an instance of `plugin`, in `instantiate()` */
+static inline void
+trace_init(SimpleLV2Trace*           trace,
+           const char*               plugin,
+           const LV2_Feature* const* features)
+{
+	const char* dir = getenv("SIMPLE_LV2_TRACE_DIR");
+	trace->id = __atomic_add_fetch(&trace_instances, 1, __ATOMIC_RELAXED);
+	trace->pid = (int)getpid();
+	trace->plugin = plugin;
+	snprintf(trace->path, sizeof(trace->path), "%s/%s-%d-%u.json",
+	         dir ? dir : ".", plugin, trace->pid, trace->id);
+	for (int i = 0; features && features[i]; i++) {
+		if (!strcmp(features[i]->URI, LV2_WORKER__schedule)) {
+			trace->schedule = (const LV2_Worker_Schedule*)features[i]->data;
+		}
+	}
+}
+
+static inline void
+trace_begin(SimpleLV2Trace* trace)
+{
+	trace->start_ns = trace_now_ns();
+}
+
+/** Record the block, and schedule a flush if the ring fills up */
+static inline void
+trace_end(SimpleLV2Trace* trace, uint32_t n_samples)
+{
+	const uint64_t end_ns = trace_now_ns();
+	const uint32_t write_index = trace->write_index;
+	const uint32_t used = write_index -
+		__atomic_load_n(&trace->read_index, __ATOMIC_ACQUIRE);
+
+	if (used >= TRACE_RING_SIZE) {
+		__atomic_store_n(&trace->dropped, trace->dropped + 1,
+		                 __ATOMIC_RELAXED);
+	} else {
+		SimpleLV2TraceEvent* const event =
+			&trace->events[write_index & (TRACE_RING_SIZE - 1)];
+		event->start_ns = trace->start_ns;
+		event->duration_ns = (uint32_t)(end_ns - trace->start_ns);
+		event->n_samples = n_samples;
+		__atomic_store_n(&trace->write_index, write_index + 1,
+		                 __ATOMIC_RELEASE);
+	}
+
+	if (used + 1 >= TRACE_FLUSH_LEVEL && trace->schedule &&
+	    !__atomic_load_n(&trace->flush_pending, __ATOMIC_ACQUIRE)) {
+		static const uint32_t token = 0;
+		__atomic_store_n(&trace->flush_pending, 1, __ATOMIC_RELAXED);
+		if (trace->schedule->schedule_work(
+			    trace->schedule->handle, sizeof(token), &token)) {
+			__atomic_store_n(&trace->flush_pending, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+   Write pending events to the trace file, opening it if needed.  Called by
+   the worker, or in `cleanup()`.
+*/
+static inline void
+trace_flush(SimpleLV2Trace* trace)
+{
+	if (!trace->file) {
+		trace->file = fopen(trace->path, "w");
+		if (!trace->file) {
+			return;
+		}
+		fprintf(trace->file, "[\n");
+	}
+
+	uint32_t read_index = trace->read_index;
+	const uint32_t write_index =
+		__atomic_load_n(&trace->write_index, __ATOMIC_ACQUIRE);
+	for (; read_index != write_index; read_index++) {
+		const SimpleLV2TraceEvent* const event =
+			&trace->events[read_index & (TRACE_RING_SIZE - 1)];
+		fprintf(trace->file,
+		        "{\"name\":\"run\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+		        "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+		        "\"args\":{\"n_samples\":%u}},\n",
+		        trace->plugin, trace->pid, trace->id, event->start_ns / 1000.0,
+		        event->duration_ns / 1000.0, event->n_samples);
+	}
+	__atomic_store_n(&trace->read_index, read_index, __ATOMIC_RELEASE);
+
+	const uint32_t dropped = __atomic_load_n(&trace->dropped, __ATOMIC_RELAXED);
+	if (dropped != trace->written_dropped) {
+		fprintf(trace->file,
+		        "{\"name\":\"dropped\",\"cat\":\"%s\",\"ph\":\"C\",\"pid\":%d,"
+		        "\"tid\":%u,\"ts\":%.3f,\"args\":{\"events\":%u}},\n",
+		        trace->plugin, trace->pid, trace->id, trace_now_ns() / 1000.0,
+		        dropped);
+		trace->written_dropped = dropped;
+	}
+	fflush(trace->file);
+}
+
+/** Flush requested by `trace_end()`, for the worker `work()` method */
+static inline LV2_Worker_Status
+trace_work(SimpleLV2Trace* trace)
+{
+	trace_flush(trace);
+	__atomic_store_n(&trace->flush_pending, 0, __ATOMIC_RELEASE);
+	return LV2_WORKER_SUCCESS;
+}
+
+/** Worker `work_response()` method, flushes send no response */
+static inline LV2_Worker_Status
+trace_work_response(LV2_Handle instance, uint32_t size, const void* body)
+{
+	(void)instance;
+	(void)size;
+	(void)body;
+	return LV2_WORKER_SUCCESS;
+}
+
+/** Write remaining events and close the file, in `cleanup()` */
+static inline void
+trace_cleanup(SimpleLV2Trace* trace)
+{
+	trace_flush(trace);
+	if (trace->file) {
+		// Close the event array with a metadata event naming the instance
+		fprintf(trace->file,
+		        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		        "\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}\n]\n",
+		        trace->pid, trace->id, trace->plugin, trace->id);
+		fclose(trace->file);
+		trace->file = NULL;
+	}
+}
+
+#define TRACE_BEGIN(inst) trace_begin(&(inst)->trace)
+#define TRACE_END(inst, n_samples) trace_end(&(inst)->trace, (n_samples))
+
+#else
+
+#define TRACE_BEGIN(inst)
+#define TRACE_END(inst, n_samples)
+
+#endif // SIMPLE_LV2_TRACING
+
+#endif // SIMPLE_LV2_TRACE_H
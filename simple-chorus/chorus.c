@@ -15,9 +15,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/** Request POSIX.1-2001 for posix_memalign() */
+#define _POSIX_C_SOURCE 200112L
+
 /** Include standard C headers */
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
    LV2 headers are based on the URI of the specification they come from, so a
@@ -28,6 +32,24 @@
 */
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+/** Host features and options, see `options.h` */
+#include "options.h"
+
+/** Optional run() instrumentation, see `instrumentation.h` */
+#include "instrumentation.h"
+
+/** Optional run() tracing, see `trace.h` */
+#include "trace.h"
+
+/** Options, statistics and worker interfaces, see `extensions.h` */
+#include "extensions.h"
+
+/** Shared DSP building blocks, see `dsp.h` */
+#include "dsp.h"
+
+/** LFO phase offset and transport sync, see `lfo_sync.h` */
+#include "lfo_sync.h"
+
 /**
    The URI is the identifier for a plugin, and how the host associates this
    implementation in code with its description in data.  In this plugin it is
@@ -46,9 +68,26 @@ typedef enum {
 	CHORUS_DEPTH = 1,
 	CHORUS_MIX = 2,
 	CHORUS_INPUT  = 3,
-	CHORUS_OUTPUT = 4
+	CHORUS_OUTPUT = 4,
+	CHORUS_PHASE = 5,
+	CHORUS_SYNC = 6,
+	CHORUS_CONTROL = 7,
+	CHORUS_LATENCY = 8,
+	CHORUS_LFO = 9,
+	CHORUS_DELAY_TIME = 10
 } PortIndex;
 
+/**
+   Processing paths selected by run() for each block, depending on parameter
+   values.  The number of blocks processed by each path is counted in the
+   instance.
+*/
+typedef enum {
+	CHORUS_PATH_FULL = 0, // generic processing
+	CHORUS_PATH_DRY  = 1, // mix is 0, output is the attenuated input
+	CHORUS_N_PATHS   = 2
+} ProcessingPath;
+
 /**
    Every plugin defines a private structure for the plugin instance.  All data
    associated with a plugin instance is stored here, and is available to
@@ -59,6 +98,11 @@ typedef enum {
 #define ADDITIONAL_DELAY_MS 10
 
 
+/**
+   Everything touched by run() is grouped at the start of the structure, so it
+   sits in the first cache lines of the (aligned) instance.  Data only used
+   outside of run() goes after it.
+*/
 typedef struct {
 	// Port buffers
 	const float* rate;
@@ -66,20 +110,108 @@ typedef struct {
 	const float* mix;
 	const float* input;
 	float*       output;
-	// Internal data
+	const float* phase;
+	const float* sync;
+	const LV2_Atom_Sequence* control; // NULL if not connected
+	float*       latency; // NULL if not connected
+	float*       lfo; // NULL if not connected
+	float*       delay_time; // NULL if not connected
+	// Internal data used in run()
 	float* delay_buffer;
 	unsigned int delay_buffer_size;
 	unsigned int write_head;
-	float progression;
-	double sampling_rate;
+	uint64_t progression;
+	LfoSync lfo_sync;
+	float delay_offset;    // ADDITIONAL_DELAY_MS in samples
+	float delay_amplitude; // MAX_CHORUS_AMPLITUDE_MS in samples
+	// Scratch buffer, holding the delay in samples of each sample of the
+	// current chunk
+	float* scratch;
+	uint32_t scratch_length;
+	// Cold data
+	InstanceOptions options; // run() only reads the sampling rate
+	LfoSyncURIDs sync_urids;
+	uint32_t path_count[CHORUS_N_PATHS];
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+	SimpleLV2Probe probe;
+#endif
+#ifdef SIMPLE_LV2_TRACING
+	SimpleLV2Trace trace;
+#endif
 } Chorus;
 
+/** Return the delay line size in samples for the sampling rate `rate` */
+static unsigned int
+get_delay_buffer_size(double rate)
+{
+	return (unsigned int)(
+		1 + (MAX_CHORUS_AMPLITUDE_MS + ADDITIONAL_DELAY_MS) * rate / 1000.0f);
+}
+
+/** Clear the processing state, as if nothing had been processed yet */
+static void
+reset(Chorus* chorus)
+{
+	memset(chorus->delay_buffer, 0,
+	       chorus->delay_buffer_size * sizeof(float));
+	chorus->write_head = 0;
+	chorus->progression = 0;
+	lfo_sync_reset(&chorus->lfo_sync);
+}
+
+/**
+   Adapt the instance to new options, see `UpdateOptionsFunction`.  The delay
+   line is sized for the sampling rate, and the scratch buffer for the block
+   lengths.  Buffers that change size are all allocated before any is
+   replaced, so the instance is unchanged if an allocation fails.  A new
+   sampling rate clears the processing state.
+*/
+static uint32_t
+update_options(LV2_Handle instance, const InstanceOptions* options)
+{
+	Chorus* chorus = (Chorus*)instance;
+	const double rate = options->rate;
+	const unsigned int size = get_delay_buffer_size(rate);
+	const uint32_t length = get_scratch_length(options->max_block_length,
+	                                           options->nominal_block_length);
+	void* delay_buffer;
+	void* scratch;
+	if (!replacement_buffer(chorus->delay_buffer,
+	                        chorus->delay_buffer_size * sizeof(float),
+	                        size * sizeof(float), &delay_buffer)) {
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+	if (!replacement_buffer(chorus->scratch,
+	                        chorus->scratch_length * sizeof(float),
+	                        length * sizeof(float), &scratch)) {
+		aligned_free(delay_buffer);
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+
+	if (delay_buffer) {
+		aligned_free(chorus->delay_buffer);
+		chorus->delay_buffer = (float*)delay_buffer;
+		chorus->delay_buffer_size = size;
+	}
+	if (scratch) {
+		aligned_free(chorus->scratch);
+		chorus->scratch = (float*)scratch;
+		chorus->scratch_length = length;
+	}
+	if (rate != chorus->options.rate) {
+		chorus->delay_offset = ADDITIONAL_DELAY_MS * rate / 1000.0;
+		chorus->delay_amplitude = MAX_CHORUS_AMPLITUDE_MS * rate / 1000.0;
+		reset(chorus);
+	}
+	return LV2_OPTIONS_SUCCESS;
+}
+
 /**
    The `instantiate()` function is called by the host to create a new plugin
    instance.  The host passes the plugin descriptor, sample rate, and bundle
    path for plugins that need to load additional resources (e.g. waveforms).
    The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   extensions, this plugin uses the URID map and the options if provided.
 
    This function is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -90,12 +222,26 @@ instantiate(const LV2_Descriptor*     descriptor,
             const char*               bundle_path,
             const LV2_Feature* const* features)
 {
-	Chorus* chorus = (Chorus*)calloc(1, sizeof(Chorus));
-	chorus->sampling_rate = sampling_rate;
-	chorus->delay_buffer_size = 1 + (MAX_CHORUS_AMPLITUDE_MS
-		+ ADDITIONAL_DELAY_MS) * sampling_rate/1000.0f;
-	chorus->delay_buffer = (float*)calloc(chorus->delay_buffer_size,
-	                                    sizeof(float));
+	Chorus* chorus = (Chorus*)aligned_calloc(sizeof(Chorus));
+	if (!chorus) {
+		return NULL;
+	}
+	const LV2_URID_Map* map =
+		(const LV2_URID_Map*)get_feature(features, LV2_URID__map);
+	if (map) {
+		map_lfo_sync_urids(map, &chorus->sync_urids);
+	}
+	if (!init_instance_options(&chorus->options, chorus, update_options,
+	                           sampling_rate, features)) {
+		aligned_free(chorus->delay_buffer);
+		aligned_free(chorus->scratch);
+		aligned_free(chorus);
+		return NULL;
+	}
+
+#ifdef SIMPLE_LV2_TRACING
+	trace_init(&chorus->trace, "simple-chorus", features);
+#endif
 
 	return (LV2_Handle)chorus;
 }
@@ -121,22 +267,41 @@ connect_port(LV2_Handle instance,
 		break;
 	case CHORUS_DEPTH:
 		chorus->depth = (const float*)data;
+		break;
 	case CHORUS_MIX:
 		chorus->mix = (const float*)data;
+		break;
 	case CHORUS_INPUT:
 		chorus->input = (const float*)data;
 		break;
 	case CHORUS_OUTPUT:
 		chorus->output = (float*)data;
 		break;
+	case CHORUS_PHASE:
+		chorus->phase = (const float*)data;
+		break;
+	case CHORUS_SYNC:
+		chorus->sync = (const float*)data;
+		break;
+	case CHORUS_CONTROL:
+		chorus->control = (const LV2_Atom_Sequence*)data;
+		break;
+	case CHORUS_LATENCY:
+		chorus->latency = (float*)data;
+		break;
+	case CHORUS_LFO:
+		chorus->lfo = (float*)data;
+		break;
+	case CHORUS_DELAY_TIME:
+		chorus->delay_time = (float*)data;
+		break;
 	}
 }
 
 /**
    The `activate()` method is called by the host to initialise and prepare the
    plugin instance for running.  The plugin must reset all internal state
-   except for buffer locations set by `connect_port()`.  Since this plugin has
-   no other internal state, this method does nothing.
+   except for buffer locations set by `connect_port()`.
 
    This method is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -144,83 +309,139 @@ connect_port(LV2_Handle instance,
 static void
 activate(LV2_Handle instance)
 {
+	reset((Chorus*)instance);
 }
 
-/** Define a macro for converting a gain in dB to a coefficient. */
-#define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
-
-/** PI constant */
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif//M_PI
-
 /**
-   The `run()` method is the main process function of the plugin.  It processes
-   a block of audio in the audio context.  Since this plugin is
-   `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
-   a mutex) or memory allocation are not allowed.
+   Generic processing, used when no faster path applies.
 */
-static void
-run(LV2_Handle instance, uint32_t n_samples)
+DSP_KERNEL static void
+run_full(Chorus* chorus, uint64_t delta, float depth, float mix,
+         uint32_t n_samples)
 {
-	Chorus* chorus = (Chorus*)instance;
-
-	// Port
-	const float rate = *(chorus->rate);
-	const float depth = *(chorus->depth);
-	const float mix = *(chorus->mix);
 	const float* const input  = chorus->input;
 	float* const       output = chorus->output;
 	// Internal data
 	float * const delay_buffer = chorus->delay_buffer;
+	float * const delay_curve = chorus->scratch;
+	const uint32_t scratch_length = chorus->scratch_length;
 	unsigned int delay_buffer_size = chorus->delay_buffer_size;
-	double sampling_rate = chorus->sampling_rate;
-	float progression = chorus->progression;
-
-	float delta = rate / (float)sampling_rate;
-
-	for (uint32_t pos = 0; pos < n_samples; pos++) {
-		float input_sample = input[pos];
-		delay_buffer[chorus->write_head] = input_sample;
-
-		float modulant =  0.5f * ( 1.0f +
-			(sinf(2.0f * (float)M_PI * progression)));
-		progression += delta;
-		if (progression > 1.0f) {
-			progression += -1.0f;
+	unsigned int write_head = chorus->write_head;
+	uint64_t progression = chorus->progression;
+
+	// Delay is center +/- swing around the middle of the modulation range
+	float swing = 0.5f * depth * chorus->delay_amplitude;
+	float center = chorus->delay_offset + swing;
+
+	for (uint32_t offset = 0; offset < n_samples;
+	     offset += scratch_length) {
+		uint32_t chunk_size = n_samples - offset;
+		if (chunk_size > scratch_length) {
+			chunk_size = scratch_length;
 		}
 
-		float delay_in_sample = ((depth * modulant  * 
-			(float)MAX_CHORUS_AMPLITUDE_MS) + (float)ADDITIONAL_DELAY_MS) *
-			(float)sampling_rate / 1000.0f;
+		// First pass, compute the delay trajectory of the chunk. Phase is
+		// computed from the chunk start so iterations are independent.
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			delay_curve[i] = center +
+				swing * lfo_value(progression, delta, i);
+		}
+		progression = lfo_advance(progression, delta, chunk_size);
+
+		// Second pass, write input, read delay line and mix
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			uint32_t pos = offset + i;
+			float input_sample = input[pos];
+			delay_buffer[write_head] = input_sample;
+
+			float interpolated_sample = read_delay_line(
+				delay_buffer, delay_buffer_size, write_head,
+				delay_curve[i]);
+			float output_sample =
+				mix_dry_wet(input_sample, interpolated_sample, mix);
+
+			write_head = ring_advance(write_head, 1, delay_buffer_size);
+			output[pos] = output_sample;
+		}
+	}
+	chorus->write_head = write_head;
+	chorus->progression = progression;
+}
 
-		float delay_in_sample_i; //integral part
-		float delay_in_sample_d; //decimal part
-		delay_in_sample_d = modff(delay_in_sample, &delay_in_sample_i);
+/**
+   Processing when mix is 0.  Output is the attenuated input, the
+   delay line still records the input and the LFO still runs, so everything is
+   in place when parameters change again.
+*/
+static void
+run_dry(Chorus* chorus, uint64_t delta, uint32_t n_samples)
+{
+	const float* const input  = chorus->input;
+	float* const       output = chorus->output;
 
-		int read_head_a = chorus->write_head - (int)delay_in_sample_i;
-		//int read_head_b = read_head_a - 1;
-		if (read_head_a < 0) read_head_a += delay_buffer_size;
-		int read_head_b = read_head_a - 1;
-		if (read_head_b < 0) read_head_b += delay_buffer_size;
+	chorus->write_head = write_delay_line(chorus->delay_buffer,
+	                                      chorus->delay_buffer_size,
+	                                      chorus->write_head,
+	                                      input,
+	                                      n_samples);
+	chorus->progression = lfo_advance(chorus->progression, delta, n_samples);
+	scale_block(output, input, 0.5f, n_samples);
+}
 
-		float sample_a = delay_buffer[read_head_a];
-		float sample_b = delay_buffer[read_head_b];
-		float interpolated_sample = (1.0f - delay_in_sample_d) * sample_a + 
-			delay_in_sample_d * sample_b;
+/**
+   The `run()` method is the main process function of the plugin.  It processes
+   a block of audio in the audio context.  Since this plugin is
+   `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
+   a mutex) or memory allocation are not allowed.
+*/
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+	Chorus* chorus = (Chorus*)instance;
+	STATS_BEGIN(chorus);
+	TRACE_BEGIN(chorus);
+	const uint64_t fpu_mode = denormals_disable();
+
+	// Port, clamped to the ranges of chorus.ttl
+	const float rate = sanitize_control(*(chorus->rate), 0.0f, 20.0f, 0.4f);
+	const float depth = sanitize_control(*(chorus->depth), 0.0f, 1.0f, 0.33f);
+	const float mix = sanitize_control(*(chorus->mix), 0.0f, 1.0f, 0.5f);
+	const float phase =
+		sanitize_control(*(chorus->phase), 0.0f, 360.0f, 0.0f);
+	const float sync = sanitize_control(*(chorus->sync), 0.0f, 1.0f, 0.0f);
+
+	uint64_t delta = lfo_delta(rate, chorus->options.rate);
+	// LFO phase at the block start, and increment, from the transport when
+	// synced
+	chorus->progression = lfo_sync_phase(&chorus->lfo_sync,
+	                                     &chorus->sync_urids,
+	                                     chorus->control, sync > 0.0f, phase,
+	                                     chorus->progression, &delta);
+
+	if (mix == 0.0f) {
+		run_dry(chorus, delta, n_samples);
+		chorus->path_count[CHORUS_PATH_DRY]++;
+	} else {
+		run_full(chorus, delta, depth, mix, n_samples);
+		chorus->path_count[CHORUS_PATH_FULL]++;
+	}
 
-		float output_sample = 0.5f * 
-			((1.0f - mix)* input_sample + mix * interpolated_sample);
+	lfo_sync_advance(&chorus->lfo_sync, n_samples);
 
-		chorus->write_head++;
-		if (chorus->write_head >= delay_buffer_size) {
-			chorus->write_head -= delay_buffer_size;
-		}
-		output[pos] = output_sample;
-		chorus->progression = progression;
+	write_control_output(chorus->latency, 0.0f);
 
+	// LFO and modulated delay (as in run_full()) at the start of the next
+	// block, for meters
+	const float lfo = lfo_value(chorus->progression, delta, 0);
+	const float swing = 0.5f * depth * chorus->delay_amplitude;
+	write_control_output(chorus->lfo, lfo);
+	write_control_output(chorus->delay_time,
+	                     (chorus->delay_offset + swing + swing * lfo) *
+	                     1000.0f / (float)chorus->options.rate);
 
-	}
+	denormals_restore(fpu_mode);
+	TRACE_END(chorus, n_samples);
+	STATS_END(chorus, n_samples, chorus->path_count, CHORUS_N_PATHS, 0);
 }
 
 /**
@@ -249,26 +470,17 @@ static void
 cleanup(LV2_Handle instance)
 {
 	Chorus* chorus = (Chorus*)instance;
+#ifdef SIMPLE_LV2_TRACING
+	trace_cleanup(&chorus->trace);
+#endif
 	chorus->delay_buffer_size = 0;
-	free(chorus->delay_buffer);
-	free(instance);
+	aligned_free(chorus->delay_buffer);
+	aligned_free(chorus->scratch);
+	aligned_free(instance);
 }
 
-/**
-   The `extension_data()` function returns any extension data supported by the
-   plugin.  Note that this is not an instance method, but a function on the
-   plugin descriptor.  It is usually used by plugins to implement additional
-   interfaces.  This plugin does not have any extension data, so this function
-   returns NULL.
-
-   This method is in the ``discovery'' threading class, so no other functions
-   or methods in this plugin library will be called concurrently with it.
-*/
-static const void*
-extension_data(const char* uri)
-{
-	return NULL;
-}
+/** Options, statistics and worker interfaces, see `extensions.h` */
+SIMPLE_LV2_EXTENSIONS(, Chorus, update_options)
 
 /**
    Every plugin must define an `LV2_Descriptor`.  It is best to define
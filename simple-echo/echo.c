@@ -15,9 +15,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/** Request POSIX.1-2001 for posix_memalign() */
+#define _POSIX_C_SOURCE 200112L
+
 /** Include standard C headers */
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
    LV2 headers are based on the URI of the specification they come from, so a
@@ -28,6 +32,21 @@
 */
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+/** Host features and options, see `options.h` */
+#include "options.h"
+
+/** Optional run() instrumentation, see `instrumentation.h` */
+#include "instrumentation.h"
+
+/** Optional run() tracing, see `trace.h` */
+#include "trace.h"
+
+/** Options, statistics and worker interfaces, see `extensions.h` */
+#include "extensions.h"
+
+/** Shared DSP building blocks, see `dsp.h` */
+#include "dsp.h"
+
 /**
    The URI is the identifier for a plugin, and how the host associates this
    implementation in code with its description in data.  In this plugin it is
@@ -45,9 +64,34 @@ typedef enum {
 	ECHO_DELAY   = 0,
 	ECHO_FEEDBACK = 1,
 	ECHO_INPUT  = 2,
-	ECHO_OUTPUT = 3
+	ECHO_OUTPUT = 3,
+	ECHO_LOWPASS = 4,
+	ECHO_HIGHPASS = 5,
+	ECHO_WOW_DEPTH = 6,
+	ECHO_WOW_RATE = 7,
+	ECHO_LATENCY = 8,
+	ECHO_LFO = 9,
+	ECHO_DELAY_TIME = 10,
+	ECHO_TAIL = 11,
+	ECHO_DUCK = 12,
+	ECHO_DUCK_ATTACK = 13,
+	ECHO_DUCK_RELEASE = 14,
+	ECHO_SIDECHAIN = 15
 } PortIndex;
 
+/**
+   Processing paths selected by run() for each block, depending on parameter
+   values and port connections.  The number of blocks processed by each path
+   is counted in the instance.
+*/
+typedef enum {
+	ECHO_PATH_FULL         = 0, // generic processing
+	ECHO_PATH_NO_FEEDBACK  = 1, // feedback is 0, output is a copy of input
+	ECHO_PATH_PASS_THROUGH = 2, // as above with in-place ports, no copy
+	ECHO_PATH_TAPE         = 3, // filtered feedback or modulated delay
+	ECHO_N_PATHS           = 4
+} ProcessingPath;
+
 /**
    Every plugin defines a private structure for the plugin instance.  All data
    associated with a plugin instance is stored here, and is available to
@@ -60,27 +104,226 @@ typedef enum {
 #define MAX_DELAY_IN_SAMPLE 44100  // 1 sec at 44100hz
 #define DELAY_BUFFER_SIZE (MAX_DELAY_IN_SAMPLE + 1)
 
+/**
+   Feedback filters are bypassed at the end of their range, so with default
+   settings the echo sounds (and costs) as it did without them.
+*/
+#define LOWPASS_OFF_HZ 20000.0f
+#define HIGHPASS_OFF_HZ 20.0f
+
+/**
+   The tape echo computes its wow LFO every `WOW_STEP` samples and
+   interpolates it linearly in between, since a sine per sample was most of
+   its cost.  At the highest wow rate and depth, the delay is off by at most
+   0.015 samples at 44.1 kHz, and less at higher rates.
+*/
+#define WOW_STEP 16
+
+/**
+   Ducking attenuates the repeats in the output while the input, or the
+   sidechain if connected, is loud.  The attenuation is half of the duck depth
+   at this envelope level (about -26 dBFS), and tends to the full depth above.
+   The delay line records the repeats unducked, so they come back at their
+   normal level when the input stops.
+*/
+#define DUCK_KNEE 0.05f
+
+/** Ducking settings of a block */
+typedef struct {
+	float depth; // 0 if off
+	float attack_coef;
+	float release_coef;
+} Ducking;
+
+/**
+   With `SIMPLE_LV2_COMPACT_DELAY` (`./waf configure --compact-delay`), the
+   delay line holds 16-bit samples instead of floats, halving the memory used
+   by an instance for some added noise and a slower echo, see the compact delay
+   line in `common/dsp.h`.  It is off by default.  Kernels access the delay
+   line through the functions below, which are plain float accesses otherwise.
+*/
+#ifdef SIMPLE_LV2_COMPACT_DELAY
+typedef CompactSample DelaySample;
+#else
+typedef float DelaySample;
+#endif
+
+static inline DelaySample
+store_delay(float sample, uint32_t dither_counter)
+{
+#ifdef SIMPLE_LV2_COMPACT_DELAY
+	return compact_encode(sample, dither_counter);
+#else
+	(void)dither_counter;
+	return sample;
+#endif
+}
+
+static inline float
+load_delay(DelaySample sample)
+{
+#ifdef SIMPLE_LV2_COMPACT_DELAY
+	return compact_decode(sample);
+#else
+	return sample;
+#endif
+}
+
+static inline float
+read_echo_delay_line(const DelaySample* delay_buffer,
+                     unsigned int       delay_buffer_size,
+                     unsigned int       write_head,
+                     float              delay_in_sample)
+{
+#ifdef SIMPLE_LV2_COMPACT_DELAY
+	return read_compact_delay_line(delay_buffer, delay_buffer_size, write_head,
+	                               delay_in_sample);
+#else
+	return read_delay_line(delay_buffer, delay_buffer_size, write_head,
+	                       delay_in_sample);
+#endif
+}
+
+static inline unsigned int
+write_echo_delay_line(DelaySample* delay_buffer,
+                      unsigned int delay_buffer_size,
+                      unsigned int write_head,
+                      const float* input,
+                      uint32_t     n_samples,
+                      uint32_t*    dither_counter)
+{
+#ifdef SIMPLE_LV2_COMPACT_DELAY
+	return write_compact_delay_line(delay_buffer, delay_buffer_size,
+	                                write_head, input, n_samples,
+	                                dither_counter);
+#else
+	(void)dither_counter;
+	return write_delay_line(delay_buffer, delay_buffer_size, write_head,
+	                        input, n_samples);
+#endif
+}
 
+/**
+   Everything touched by run() is grouped at the start of the structure, so it
+   sits in the first cache lines of the (aligned) instance.  Data only used
+   outside of run() goes after it.
+*/
 typedef struct {
 	// Port buffers
 	const float* delay;
 	const float* feedback;
 	const float* input;
 	float*       output;
-	//float delay_buffer[DELAY_BUFFER_SIZE];
-	float* delay_buffer;
+	const float* lowpass;
+	const float* highpass;
+	const float* wow_depth;
+	const float* wow_rate;
+	float*       latency; // NULL if not connected
+	float*       lfo; // NULL if not connected
+	float*       delay_time; // NULL if not connected
+	float*       tail; // NULL if not connected
+	const float* duck;
+	const float* duck_attack;
+	const float* duck_release;
+	const float* sidechain; // NULL if not connected
+	// Internal data used in run()
+	DelaySample* delay_buffer;
 	unsigned int delay_buffer_size;
 	unsigned int write_head;
-	unsigned int read_head;
-	double rate;
+	uint32_t dither_counter; // samples stored, for the compact delay dither
+	float lowpass_state;
+	float highpass_state;
+	uint64_t wow_progression;
+	float tail_energy; // sum of the squared repeats of the last block
+	float duck_envelope;
+	// Scratch buffers, holding for each sample of the current chunk the
+	// modulated delay in samples, and the gain of the repeats
+	float* scratch;
+	float* duck_gains; // second half of `scratch`
+	uint32_t scratch_length;
+	// Cold data
+	InstanceOptions options; // run() only reads the sampling rate
+	uint32_t path_count[ECHO_N_PATHS];
+	uint32_t rescue_count; // blocks with non-finite values cleared
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+	SimpleLV2Probe probe;
+#endif
+#ifdef SIMPLE_LV2_TRACING
+	SimpleLV2Trace trace;
+#endif
 } Echo;
 
+/** Return the delay line size in samples for the sampling rate `rate` */
+static unsigned int
+get_delay_buffer_size(double rate)
+{
+	return (unsigned int)(rate * MAX_DELAY_IN_SEC + 1);
+}
+
+/** Clear the processing state, as if nothing had been processed yet */
+static void
+reset(Echo* echo)
+{
+	memset(echo->delay_buffer, 0,
+	       echo->delay_buffer_size * sizeof(DelaySample));
+	echo->write_head = 0;
+	echo->lowpass_state = 0.0f;
+	echo->highpass_state = 0.0f;
+	echo->wow_progression = 0;
+	echo->duck_envelope = 0.0f;
+}
+
+/**
+   Adapt the instance to new options, see `UpdateOptionsFunction`.  The delay
+   line is sized for the sampling rate, and the scratch buffers for the block
+   lengths.  Buffers that change size are all allocated before any is
+   replaced, so the instance is unchanged if an allocation fails.  A new
+   sampling rate clears the processing state.
+*/
+static uint32_t
+update_options(LV2_Handle instance, const InstanceOptions* options)
+{
+	Echo* echo = (Echo*)instance;
+	const unsigned int size = get_delay_buffer_size(options->rate);
+	const uint32_t length = get_scratch_length(options->max_block_length,
+	                                           options->nominal_block_length);
+	void* delay_buffer;
+	void* scratch;
+	if (!replacement_buffer(echo->delay_buffer,
+	                        echo->delay_buffer_size * sizeof(DelaySample),
+	                        size * sizeof(DelaySample), &delay_buffer)) {
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+	if (!replacement_buffer(echo->scratch,
+	                        2 * echo->scratch_length * sizeof(float),
+	                        2 * length * sizeof(float), &scratch)) {
+		aligned_free(delay_buffer);
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+
+	if (delay_buffer) {
+		aligned_free(echo->delay_buffer);
+		echo->delay_buffer = (DelaySample*)delay_buffer;
+		echo->delay_buffer_size = size;
+	}
+	if (scratch) {
+		aligned_free(echo->scratch);
+		echo->scratch = (float*)scratch;
+		echo->duck_gains = echo->scratch + length;
+		echo->scratch_length = length;
+	}
+	if (options->rate != echo->options.rate) {
+		reset(echo);
+	}
+	return LV2_OPTIONS_SUCCESS;
+}
+
 /**
    The `instantiate()` function is called by the host to create a new plugin
    instance.  The host passes the plugin descriptor, sample rate, and bundle
    path for plugins that need to load additional resources (e.g. waveforms).
    The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   extensions, this plugin uses the URID map and the options if provided.
 
    This function is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -91,11 +334,21 @@ instantiate(const LV2_Descriptor*     descriptor,
             const char*               bundle_path,
             const LV2_Feature* const* features)
 {
-	Echo* echo = (Echo*)calloc(1, sizeof(Echo));
-	echo->rate = rate;
-	echo->delay_buffer_size = rate * MAX_DELAY_IN_SEC + 1;
-	echo->delay_buffer = (float*)calloc(echo->delay_buffer_size,
-	                                    sizeof(float));
+	Echo* echo = (Echo*)aligned_calloc(sizeof(Echo));
+	if (!echo) {
+		return NULL;
+	}
+	if (!init_instance_options(&echo->options, echo, update_options,
+	                           rate, features)) {
+		aligned_free(echo->delay_buffer);
+		aligned_free(echo->scratch);
+		aligned_free(echo);
+		return NULL;
+	}
+
+#ifdef SIMPLE_LV2_TRACING
+	trace_init(&echo->trace, "simple-echo", features);
+#endif
 
 	return (LV2_Handle)echo;
 }
@@ -121,20 +374,56 @@ connect_port(LV2_Handle instance,
 		break;
 	case ECHO_FEEDBACK:
 		echo->feedback = (const float*)data;
+		break;
 	case ECHO_INPUT:
 		echo->input = (const float*)data;
 		break;
 	case ECHO_OUTPUT:
 		echo->output = (float*)data;
 		break;
+	case ECHO_LOWPASS:
+		echo->lowpass = (const float*)data;
+		break;
+	case ECHO_HIGHPASS:
+		echo->highpass = (const float*)data;
+		break;
+	case ECHO_WOW_DEPTH:
+		echo->wow_depth = (const float*)data;
+		break;
+	case ECHO_WOW_RATE:
+		echo->wow_rate = (const float*)data;
+		break;
+	case ECHO_LATENCY:
+		echo->latency = (float*)data;
+		break;
+	case ECHO_LFO:
+		echo->lfo = (float*)data;
+		break;
+	case ECHO_DELAY_TIME:
+		echo->delay_time = (float*)data;
+		break;
+	case ECHO_TAIL:
+		echo->tail = (float*)data;
+		break;
+	case ECHO_DUCK:
+		echo->duck = (const float*)data;
+		break;
+	case ECHO_DUCK_ATTACK:
+		echo->duck_attack = (const float*)data;
+		break;
+	case ECHO_DUCK_RELEASE:
+		echo->duck_release = (const float*)data;
+		break;
+	case ECHO_SIDECHAIN:
+		echo->sidechain = (const float*)data;
+		break;
 	}
 }
 
 /**
    The `activate()` method is called by the host to initialise and prepare the
    plugin instance for running.  The plugin must reset all internal state
-   except for buffer locations set by `connect_port()`.  Since this plugin has
-   no other internal state, this method does nothing.
+   except for buffer locations set by `connect_port()`.
 
    This method is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -142,10 +431,271 @@ connect_port(LV2_Handle instance,
 static void
 activate(LV2_Handle instance)
 {
+	reset((Echo*)instance);
+}
+
+/** Return the gain applied to the repeats for an envelope level */
+static inline float
+duck_gain(float level, float depth)
+{
+	return 1.0f - depth * level / (level + DUCK_KNEE);
+}
+
+/**
+   Update the ducking envelope with a step of `n_samples` samples of `key`,
+   and ramp the gain from `*gain` to the new one in `gains`.
+*/
+static inline void
+duck_step(Echo* echo, const Ducking* ducking, const float* key, float* gains,
+          uint32_t n_samples, float* gain)
+{
+	const float level = envelope_run(&echo->duck_envelope,
+	                                 envelope_peak(key, n_samples),
+	                                 ducking->attack_coef,
+	                                 ducking->release_coef);
+	const float next_gain = duck_gain(level, ducking->depth);
+	ramp_block(gains, *gain, next_gain, n_samples);
+	*gain = next_gain;
+}
+
+/**
+   Write in `duck_gains` the gain of the repeats for the `n_samples` samples
+   of a chunk, from the envelope of `key`, and return it.  The gain is
+   computed once per envelope step, and ramped in between.  Without ducking,
+   the envelope is not followed and NULL is returned: the gains are not
+   written, so an idle instance doesn't pull them into the cache.  The
+   envelope is then reset, so ducking starts again from silence rather than
+   from the level it was left at.
+*/
+static inline const float*
+duck_chunk(Echo* echo, const Ducking* ducking, const float* key,
+           uint32_t n_samples)
+{
+	float* const gains = echo->duck_gains;
+
+	if (ducking->depth == 0.0f) {
+		echo->duck_envelope = 0.0f;
+		return NULL;
+	}
+	float gain = duck_gain(echo->duck_envelope, ducking->depth);
+	uint32_t start = 0;
+	// Full steps have a constant length, so their loops are unrolled
+	for (; start + ENVELOPE_STEP <= n_samples; start += ENVELOPE_STEP) {
+		duck_step(echo, ducking, key + start, gains + start, ENVELOPE_STEP,
+		          &gain);
+	}
+	if (start < n_samples) {
+		const uint32_t length = n_samples - start;
+		const Ducking partial = {
+			ducking->depth,
+			envelope_step_coef(ducking->attack_coef, length),
+			envelope_step_coef(ducking->release_coef, length)
+		};
+		duck_step(echo, &partial, key + start, gains + start, length, &gain);
+	}
+	return gains;
+}
+
+/** Return the delay of run_full() in samples, for a `delay` in seconds */
+static inline unsigned int
+full_delay(const Echo* echo, float delay)
+{
+	const double delay_in_sample = delay * echo->options.rate;
+	return (unsigned int)(delay_in_sample > 1 ? delay_in_sample : 1);
+}
+
+/**
+   Generic processing, used when no faster path applies.  The block is
+   processed in chunks of the scratch length, for the ducking gains.
+*/
+DSP_KERNEL static void
+run_full(Echo* echo, float delay, float feedback, const Ducking* ducking,
+         uint32_t n_samples)
+{
+	const float* const input  = echo->input;
+	const float* const key    = echo->sidechain ? echo->sidechain : input;
+	float* const       output = echo->output;
+	DelaySample * const delay_buffer = echo->delay_buffer;
+	const uint32_t scratch_length = echo->scratch_length;
+	unsigned int delay_buffer_size = echo->delay_buffer_size;
+	unsigned int write_head = echo->write_head;
+	uint32_t dither_counter = echo->dither_counter;
+	float tail_energy = 0.0f;
+
+	const unsigned int delay_in_sample = full_delay(echo, delay);
+
+	for (uint32_t offset = 0; offset < n_samples; offset += scratch_length) {
+		uint32_t chunk_size = n_samples - offset;
+		if (chunk_size > scratch_length) {
+			chunk_size = scratch_length;
+		}
+
+		// Key is read before output is written, they may be the same buffer
+		const float* const duck_gains =
+			duck_chunk(echo, ducking, key + offset, chunk_size);
+
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			uint32_t pos = offset + i;
+			float input_sample = input[pos];
+			int read_head = write_head - delay_in_sample;
+			if (read_head < 0) {
+				read_head += delay_buffer_size;
+			}
+			float delay_sample = load_delay(delay_buffer[read_head]);
+			float repeat_sample = feedback * delay_sample;
+			float output_sample = input_sample + repeat_sample;
+			tail_energy += repeat_sample * repeat_sample;
+			delay_buffer[write_head] =
+				store_delay(output_sample, dither_counter++);
+			write_head = ring_advance(write_head, 1, delay_buffer_size);
+			// The delay line keeps the repeats unducked
+			output[pos] = duck_gains ?
+				input_sample + duck_gains[i] * repeat_sample : output_sample;
+		}
+	}
+	echo->write_head = write_head;
+	echo->dither_counter = dither_counter;
+	echo->tail_energy = tail_energy;
 }
 
-/** Define a macro for converting a gain in dB to a coefficient. */
-#define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
+/**
+   Return the tape echo delay in samples before modulation, for a `delay` in
+   seconds, and set `swing` to the modulation depth in samples.  The delay is
+   clamped to the buffer, and the swing to the delay.
+*/
+static inline float
+tape_delay(const Echo* echo, float delay, float wow_depth, float* swing)
+{
+	const float rate = echo->options.rate;
+
+	// Longest delay leaves room for the interpolation sample
+	delay *= rate;
+	if (delay > (float)(echo->delay_buffer_size - 2)) {
+		delay = (float)(echo->delay_buffer_size - 2);
+	}
+	if (delay < 1.0f) {
+		delay = 1.0f;
+	}
+	// Modulation shortens the delay by up to `swing` samples
+	*swing = wow_depth * rate / 1000.0f;
+	if (*swing > delay - 1.0f) {
+		*swing = delay - 1.0f;
+	}
+	return delay;
+}
+
+/**
+   Processing with a tape flavour: the delay time is modulated by a slow LFO
+   (wow) and repeats go through a low-pass and a high-pass one-pole filter in
+   the feedback loop.  Like chorus and flanger, the modulated delay trajectory
+   is computed for a whole chunk before the delay line is read, from the LFO
+   every `WOW_STEP` samples.  Filter states stay in locals during the loop.
+*/
+DSP_KERNEL static void
+run_tape(Echo* echo, float delay, float feedback, float lowpass, float highpass,
+         float wow_depth, float wow_rate, const Ducking* ducking,
+         uint32_t n_samples)
+{
+	const float* const input  = echo->input;
+	const float* const key    = echo->sidechain ? echo->sidechain : input;
+	float* const       output = echo->output;
+	DelaySample * const delay_buffer = echo->delay_buffer;
+	float * const delay_curve = echo->scratch;
+	const uint32_t scratch_length = echo->scratch_length;
+	unsigned int delay_buffer_size = echo->delay_buffer_size;
+	unsigned int write_head = echo->write_head;
+	uint32_t dither_counter = echo->dither_counter;
+	const float rate = echo->options.rate;
+	float tail_energy = 0.0f;
+
+	float swing;
+	delay = tape_delay(echo, delay, wow_depth, &swing);
+	const uint64_t delta = lfo_delta(wow_rate, echo->options.rate);
+	uint64_t progression = echo->wow_progression;
+
+	// One-pole coefficients, a coefficient of 1 (low-pass) or 0 (high-pass)
+	// lets the signal through unchanged
+	const float lowpass_co = lowpass >= LOWPASS_OFF_HZ ? 1.0f :
+		onepole_coef(lowpass, rate);
+	const float highpass_co = highpass <= HIGHPASS_OFF_HZ ? 0.0f :
+		onepole_coef(highpass, rate);
+	float lowpass_state = echo->lowpass_state;
+	// With a coefficient of 0, the high-pass state is never updated: it must
+	// be 0, or a value left from when the filter was on would be subtracted
+	// from every repeat as a DC offset
+	float highpass_state = highpass_co == 0.0f ? 0.0f : echo->highpass_state;
+
+	for (uint32_t offset = 0; offset < n_samples; offset += scratch_length) {
+		uint32_t chunk_size = n_samples - offset;
+		if (chunk_size > scratch_length) {
+			chunk_size = scratch_length;
+		}
+
+		// First pass, compute the delay trajectory and the ducking gains of
+		// the chunk
+		float wow = lfo_value(progression, delta, 0);
+		for (uint32_t step = 0; step < chunk_size; step += WOW_STEP) {
+			const float next = lfo_value(progression, delta, step + WOW_STEP);
+			const float slope = (next - wow) * (1.0f / (float)WOW_STEP);
+			const uint32_t end = chunk_size - step < WOW_STEP
+				? chunk_size : step + WOW_STEP;
+			for (uint32_t i = step; i < end; i++) {
+				delay_curve[i] = delay - swing * 0.5f *
+					(1.0f + wow + slope * (float)(i - step));
+			}
+			wow = next;
+		}
+		progression = lfo_advance(progression, delta, chunk_size);
+		const float* const duck_gains =
+			duck_chunk(echo, ducking, key + offset, chunk_size);
+
+		// Second pass, read delay line, filter feedback and write
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			uint32_t pos = offset + i;
+			float input_sample = input[pos];
+
+			float delay_sample = read_echo_delay_line(
+				delay_buffer, delay_buffer_size, write_head, delay_curve[i]);
+
+			float lowpassed_sample =
+				onepole_run(&lowpass_state, lowpass_co, delay_sample);
+			float filtered_sample = lowpassed_sample -
+				onepole_run(&highpass_state, highpass_co, lowpassed_sample);
+
+			float repeat_sample = feedback * filtered_sample;
+			float output_sample = input_sample + repeat_sample;
+			tail_energy += repeat_sample * repeat_sample;
+			delay_buffer[write_head] =
+				store_delay(output_sample, dither_counter++);
+			write_head = ring_advance(write_head, 1, delay_buffer_size);
+			output[pos] = duck_gains ?
+				input_sample + duck_gains[i] * repeat_sample : output_sample;
+		}
+	}
+	echo->write_head = write_head;
+	echo->dither_counter = dither_counter;
+	echo->wow_progression = progression;
+	echo->lowpass_state = lowpass_state;
+	echo->highpass_state = highpass_state;
+	echo->tail_energy = tail_energy;
+}
+
+/**
+   Processing without feedback.  Output is the input itself, the delay line
+   still records it so that raising feedback later repeats it.
+*/
+static void
+run_no_feedback(Echo* echo, uint32_t n_samples)
+{
+	echo->write_head = write_echo_delay_line(echo->delay_buffer,
+	                                         echo->delay_buffer_size,
+	                                         echo->write_head,
+	                                         echo->input,
+	                                         n_samples,
+	                                         &echo->dither_counter);
+	copy_block(echo->output, echo->input, n_samples);
+	echo->tail_energy = 0.0f;
+}
 
 /**
    The `run()` method is the main process function of the plugin.  It processes
@@ -157,33 +707,103 @@ static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
 	Echo* echo = (Echo*)instance;
+	STATS_BEGIN(echo);
+	TRACE_BEGIN(echo);
+	const uint64_t fpu_mode = denormals_disable();
 
-	const float        delay   = *(echo->delay);
-	const float        feedback = *(echo->feedback);
-	const float* const input  = echo->input;
-	float* const       output = echo->output;
-	float * const delay_buffer = echo->delay_buffer;
-	unsigned int delay_buffer_size = echo->delay_buffer_size;
-	double rate = echo->rate;
+	// Port, clamped to the ranges of echo.ttl
+	const float delay = sanitize_control(*(echo->delay), 0.0f, 1.0f, 0.5f);
+	const float feedback =
+		sanitize_control(*(echo->feedback), 0.0f, 1.0f, 0.5f);
+	const float lowpass =
+		sanitize_control(*(echo->lowpass), 200.0f, 20000.0f, 20000.0f);
+	const float highpass =
+		sanitize_control(*(echo->highpass), 20.0f, 2000.0f, 20.0f);
+	const float wow_depth =
+		sanitize_control(*(echo->wow_depth), 0.0f, 10.0f, 0.0f);
+	const float wow_rate =
+		sanitize_control(*(echo->wow_rate), 0.05f, 10.0f, 0.5f);
+	const float duck = sanitize_control(*(echo->duck), 0.0f, 1.0f, 0.0f);
+	const float duck_attack =
+		sanitize_control(*(echo->duck_attack), 1.0f, 100.0f, 10.0f);
+	const float duck_release =
+		sanitize_control(*(echo->duck_release), 10.0f, 2000.0f, 250.0f);
 
-	const unsigned int delay_in_sample =
-		(unsigned int)((delay * rate > 1)?(delay * rate):1);
+	const Ducking ducking = {
+		duck,
+		envelope_coef(duck_attack, echo->options.rate),
+		envelope_coef(duck_release, echo->options.rate)
+	};
 
-	for (uint32_t pos = 0; pos < n_samples; pos++) {
-		float input_sample = input[pos];
-		int read_head = echo->write_head - delay_in_sample;
-		if (read_head < 0) {
-			read_head += delay_buffer_size;
-		}
-		float delay_sample = delay_buffer[read_head];
-		float output_sample = input_sample + (feedback * delay_sample);
-		delay_buffer[echo->write_head] = output_sample;
-		echo->write_head++;
-		if (echo->write_head >= delay_buffer_size) {
-			echo->write_head -= delay_buffer_size;
-		}
-		output[pos] = output_sample;
+	ProcessingPath path;
+	if (feedback == 0.0f) {
+		run_no_feedback(echo, n_samples);
+		path = echo->output == echo->input
+			? ECHO_PATH_PASS_THROUGH : ECHO_PATH_NO_FEEDBACK;
+	} else if (lowpass < LOWPASS_OFF_HZ || highpass > HIGHPASS_OFF_HZ ||
+	           wow_depth > 0.0f) {
+		run_tape(echo, delay, feedback, lowpass, highpass, wow_depth, wow_rate,
+		         &ducking, n_samples);
+		path = ECHO_PATH_TAPE;
+	} else {
+		run_full(echo, delay, feedback, &ducking, n_samples);
+		path = ECHO_PATH_FULL;
+	}
+	echo->path_count[path]++;
+	const uint64_t wow_delta = lfo_delta(wow_rate, echo->options.rate);
+	if (path != ECHO_PATH_TAPE) {
+		// The filters start from silence the next time run_tape() is used,
+		// not from the state it was left with.  The wow LFO keeps running,
+		// for its meter.
+		echo->lowpass_state = 0.0f;
+		echo->highpass_state = 0.0f;
+		echo->wow_progression =
+			lfo_advance(echo->wow_progression, wow_delta, n_samples);
+	}
+	if (path != ECHO_PATH_TAPE && path != ECHO_PATH_FULL) {
+		// Without repeats, the ducking envelope isn't followed either
+		echo->duck_envelope = 0.0f;
+	}
+
+	// Compact samples are always finite, only a float delay line is checked
+#ifndef SIMPLE_LV2_COMPACT_DELAY
+	if (rescue_delay_line(echo->delay_buffer, echo->delay_buffer_size,
+	                      echo->write_head, n_samples)) {
+		memset(echo->output, 0, n_samples * sizeof(float));
+		echo->lowpass_state = 0.0f;
+		echo->highpass_state = 0.0f;
+		echo->tail_energy = 0.0f;
+		echo->rescue_count++;
+	}
+#endif
+
+	write_control_output(echo->latency, 0.0f);
+
+	// Wow LFO and delay of the path used at the start of the next block, and
+	// level of the repeats of this block, for meters
+	const float wow = lfo_value(echo->wow_progression, wow_delta, 0);
+	float delay_in_sample;
+	if (path == ECHO_PATH_TAPE) {
+		float swing;
+		const float center = tape_delay(echo, delay, wow_depth, &swing);
+		delay_in_sample = center - swing * 0.5f * (1.0f + wow);
+	} else {
+		delay_in_sample = (float)full_delay(echo, delay);
 	}
+	const float tail_power =
+		n_samples ? echo->tail_energy / (float)n_samples : 0.0f;
+	write_control_output(echo->lfo, wow);
+	write_control_output(echo->delay_time, delay_in_sample * 1000.0f /
+	                     (float)echo->options.rate);
+	// Clamped to the port range, very loud repeats overflow the energy
+	write_control_output(echo->tail,
+	                     sanitize_control(10.0f * log10f(tail_power + 1e-9f),
+	                                      -90.0f, 12.0f, 12.0f));
+
+	denormals_restore(fpu_mode);
+	TRACE_END(echo, n_samples);
+	STATS_END(echo, n_samples, echo->path_count, ECHO_N_PATHS,
+	          echo->rescue_count);
 }
 
 /**
@@ -212,26 +832,17 @@ static void
 cleanup(LV2_Handle instance)
 {
 	Echo* echo = (Echo*)instance;
+#ifdef SIMPLE_LV2_TRACING
+	trace_cleanup(&echo->trace);
+#endif
 	echo->delay_buffer_size = 0;
-	free(echo->delay_buffer);
-	free(instance);
+	aligned_free(echo->delay_buffer);
+	aligned_free(echo->scratch);
+	aligned_free(instance);
 }
 
-/**
-   The `extension_data()` function returns any extension data supported by the
-   plugin.  Note that this is not an instance method, but a function on the
-   plugin descriptor.  It is usually used by plugins to implement additional
-   interfaces.  This plugin does not have any extension data, so this function
-   returns NULL.
-
-   This method is in the ``discovery'' threading class, so no other functions
-   or methods in this plugin library will be called concurrently with it.
-*/
-static const void*
-extension_data(const char* uri)
-{
-	return NULL;
-}
+/** Options, statistics and worker interfaces, see `extensions.h` */
+SIMPLE_LV2_EXTENSIONS(, Echo, update_options)
 
 /**
    Every plugin must define an `LV2_Descriptor`.  It is best to define
@@ -249,6 +860,337 @@ static const LV2_Descriptor descriptor = {
 	extension_data
 };
 
+/**
+   Multi-tap echo
+   ==============
+
+   A second plugin in this library, for rhythmic delays that would otherwise
+   need one echo instance per repetition.  Up to `MULTITAP_N_TAPS` taps, each
+   with its own time, gain and pan, read the same delay line, so the input is
+   stored once whatever the number of taps.  There is no feedback: the delay
+   line only holds the input.
+*/
+#define MULTITAP_URI \
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#simple-multitap-echo"
+
+/** Number of taps */
+#define MULTITAP_N_TAPS 8
+
+/**
+   Blocks are processed in chunks of at most this many samples.  The whole
+   input chunk is written in the delay line before any tap is read, and both
+   output chunks stay in the L1 cache while every tap is added to them.
+*/
+#define MULTITAP_CHUNK_LENGTH 512
+
+/**
+   Port indices.  Each tap has 3 control ports, starting at
+   `MULTITAP_TAPS + 3 * tap`: time, gain and pan.  The latency output comes
+   after the taps.
+*/
+typedef enum {
+	MULTITAP_DRY          = 0,
+	MULTITAP_INPUT        = 1,
+	MULTITAP_OUTPUT_LEFT  = 2,
+	MULTITAP_OUTPUT_RIGHT = 3,
+	MULTITAP_TAPS         = 4,
+	MULTITAP_LATENCY      = 28 // after the 8 taps
+} MultiTapPortIndex;
+
+typedef enum {
+	MULTITAP_TAP_TIME = 0,
+	MULTITAP_TAP_GAIN = 1,
+	MULTITAP_TAP_PAN  = 2,
+	MULTITAP_N_TAP_PORTS = 3
+} MultiTapTapPort;
+
+typedef enum {
+	MULTITAP_PATH_FULL = 0, // at least one tap is audible
+	MULTITAP_PATH_DRY  = 1, // every tap gain is 0, only the dry signal
+	MULTITAP_N_PATHS   = 2
+} MultiTapProcessingPath;
+
+/** Instance data, hot data first as for `Echo` */
+typedef struct {
+	// Port buffers
+	const float* dry;
+	const float* input;
+	float*       output_left;
+	float*       output_right;
+	const float* tap_time[MULTITAP_N_TAPS];
+	const float* tap_gain[MULTITAP_N_TAPS];
+	const float* tap_pan[MULTITAP_N_TAPS];
+	float*       latency; // NULL if not connected
+	// Internal data used in run()
+	float* delay_buffer;
+	unsigned int delay_buffer_size;
+	unsigned int write_head;
+	unsigned int max_delay_in_sample;
+	// Cold data
+	InstanceOptions options; // run() only reads the sampling rate
+	uint32_t path_count[MULTITAP_N_PATHS];
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+	SimpleLV2Probe probe;
+#endif
+#ifdef SIMPLE_LV2_TRACING
+	SimpleLV2Trace trace;
+#endif
+} MultiTap;
+
+static void
+multitap_reset(MultiTap* multitap)
+{
+	memset(multitap->delay_buffer, 0,
+	       multitap->delay_buffer_size * sizeof(float));
+	multitap->write_head = 0;
+}
+
+/**
+   Adapt the instance to new options, see `UpdateOptionsFunction`.  Blocks
+   are processed in chunks of a fixed length, so only a new sampling rate
+   matters: the delay line is reallocated for it, and the processing state is
+   cleared.  The delay line has room for the longest delay plus a whole chunk,
+   so writing a chunk never overwrites a sample a tap has still to read.
+*/
+static uint32_t
+multitap_update_options(LV2_Handle instance, const InstanceOptions* options)
+{
+	MultiTap* multitap = (MultiTap*)instance;
+	if (options->rate == multitap->options.rate) {
+		return LV2_OPTIONS_SUCCESS;
+	}
+	const unsigned int max_delay_in_sample =
+		(unsigned int)(options->rate * MAX_DELAY_IN_SEC);
+	const unsigned int size = max_delay_in_sample + 1 + MULTITAP_CHUNK_LENGTH;
+	void* delay_buffer;
+	if (!replacement_buffer(multitap->delay_buffer,
+	                        multitap->delay_buffer_size * sizeof(float),
+	                        size * sizeof(float), &delay_buffer)) {
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+	if (delay_buffer) {
+		aligned_free(multitap->delay_buffer);
+		multitap->delay_buffer = (float*)delay_buffer;
+		multitap->delay_buffer_size = size;
+	}
+	multitap->max_delay_in_sample = max_delay_in_sample;
+	multitap_reset(multitap);
+	return LV2_OPTIONS_SUCCESS;
+}
+
+static LV2_Handle
+multitap_instantiate(const LV2_Descriptor*     descriptor,
+                     double                    rate,
+                     const char*               bundle_path,
+                     const LV2_Feature* const* features)
+{
+	MultiTap* multitap = (MultiTap*)aligned_calloc(sizeof(MultiTap));
+	if (!multitap) {
+		return NULL;
+	}
+	if (!init_instance_options(&multitap->options, multitap,
+	                           multitap_update_options, rate, features)) {
+		aligned_free(multitap->delay_buffer);
+		aligned_free(multitap);
+		return NULL;
+	}
+
+#ifdef SIMPLE_LV2_TRACING
+	trace_init(&multitap->trace, "simple-multitap-echo", features);
+#endif
+
+	return (LV2_Handle)multitap;
+}
+
+static void
+multitap_connect_port(LV2_Handle instance,
+                      uint32_t   port,
+                      void*      data)
+{
+	MultiTap* multitap = (MultiTap*)instance;
+
+	switch ((MultiTapPortIndex)port) {
+	case MULTITAP_DRY:
+		multitap->dry = (const float*)data;
+		return;
+	case MULTITAP_INPUT:
+		multitap->input = (const float*)data;
+		return;
+	case MULTITAP_OUTPUT_LEFT:
+		multitap->output_left = (float*)data;
+		return;
+	case MULTITAP_OUTPUT_RIGHT:
+		multitap->output_right = (float*)data;
+		return;
+	case MULTITAP_LATENCY:
+		multitap->latency = (float*)data;
+		return;
+	case MULTITAP_TAPS:
+		break;
+	}
+	if (port < MULTITAP_TAPS ||
+	    port >= MULTITAP_TAPS + MULTITAP_N_TAPS * MULTITAP_N_TAP_PORTS) {
+		return;
+	}
+	const uint32_t tap = (port - MULTITAP_TAPS) / MULTITAP_N_TAP_PORTS;
+	switch ((MultiTapTapPort)((port - MULTITAP_TAPS) % MULTITAP_N_TAP_PORTS)) {
+	case MULTITAP_TAP_TIME:
+		multitap->tap_time[tap] = (const float*)data;
+		break;
+	case MULTITAP_TAP_GAIN:
+		multitap->tap_gain[tap] = (const float*)data;
+		break;
+	case MULTITAP_TAP_PAN:
+		multitap->tap_pan[tap] = (const float*)data;
+		break;
+	case MULTITAP_N_TAP_PORTS:
+		break;
+	}
+}
+
+static void
+multitap_activate(LV2_Handle instance)
+{
+	multitap_reset((MultiTap*)instance);
+}
+
+/**
+   Add `n_samples` of the delay line, starting at `read_head`, to the left and
+   right outputs with the tap `gains`.  The loop is split where the delay line
+   wraps, so each part is a plain loop over contiguous memory the compiler can
+   vectorize.
+*/
+static inline void
+add_tap(const float* delay_buffer,
+        unsigned int delay_buffer_size,
+        unsigned int read_head,
+        const float* gains,
+        float*       output_left,
+        float*       output_right,
+        uint32_t     n_samples)
+{
+	uint32_t done = 0;
+	while (done < n_samples) {
+		uint32_t span = delay_buffer_size - read_head;
+		if (span > n_samples - done) {
+			span = n_samples - done;
+		}
+		add_stereo_block(output_left + done, output_right + done,
+		                 gains[0], gains[1], delay_buffer + read_head, span);
+		done += span;
+		read_head = 0;
+	}
+}
+
+/**
+   Tap parameters are read once per block.  For each chunk, the input is
+   first written in the delay line and the dry signal in the outputs, then
+   taps are added one after the other.  Outputs are only written after the
+   input samples at the same position are read, so the input may share a
+   buffer with either output.
+*/
+DSP_KERNEL static void
+multitap_run(LV2_Handle instance, uint32_t n_samples)
+{
+	MultiTap* multitap = (MultiTap*)instance;
+	STATS_BEGIN(multitap);
+	TRACE_BEGIN(multitap);
+	const uint64_t fpu_mode = denormals_disable();
+
+	float * const delay_buffer = multitap->delay_buffer;
+	const unsigned int delay_buffer_size = multitap->delay_buffer_size;
+	// Controls are clamped to the ranges of multitap.ttl, a NaN mutes a tap
+	const float dry = sanitize_control(*(multitap->dry), 0.0f, 1.0f, 1.0f);
+
+	// Audible taps, with delay in samples and constant power pan gains
+	unsigned int tap_delay[MULTITAP_N_TAPS];
+	float tap_gains[MULTITAP_N_TAPS][2];
+	unsigned int n_taps = 0;
+	for (unsigned int t = 0; t < MULTITAP_N_TAPS; t++) {
+		const float gain =
+			sanitize_control(*(multitap->tap_gain[t]), 0.0f, 1.0f, 0.0f);
+		if (gain == 0.0f) {
+			continue;
+		}
+		const float time =
+			sanitize_control(*(multitap->tap_time[t]), 0.0f, 1.0f, 0.0f);
+		const float pan =
+			sanitize_control(*(multitap->tap_pan[t]), -1.0f, 1.0f, 0.0f);
+		float delay = time * multitap->options.rate + 0.5f;
+		if (delay > (float)multitap->max_delay_in_sample) {
+			delay = (float)multitap->max_delay_in_sample;
+		}
+		const float angle = (pan + 1.0f) * (float)M_PI / 4;
+		tap_delay[n_taps] = (unsigned int)delay;
+		tap_gains[n_taps][0] = gain * cosf(angle);
+		tap_gains[n_taps][1] = gain * sinf(angle);
+		n_taps++;
+	}
+
+	for (uint32_t offset = 0; offset < n_samples;
+	     offset += MULTITAP_CHUNK_LENGTH) {
+		uint32_t chunk_size = n_samples - offset;
+		if (chunk_size > MULTITAP_CHUNK_LENGTH) {
+			chunk_size = MULTITAP_CHUNK_LENGTH;
+		}
+		const float* const input = multitap->input + offset;
+		float* const output_left = multitap->output_left + offset;
+		float* const output_right = multitap->output_right + offset;
+		const unsigned int chunk_head = multitap->write_head;
+
+		multitap->write_head = write_delay_line(delay_buffer,
+		                                        delay_buffer_size,
+		                                        chunk_head,
+		                                        input,
+		                                        chunk_size);
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			const float dry_sample = dry * input[i];
+			output_left[i] = dry_sample;
+			output_right[i] = dry_sample;
+		}
+		for (unsigned int t = 0; t < n_taps; t++) {
+			const unsigned int read_head = ring_advance(
+				chunk_head, delay_buffer_size - tap_delay[t],
+				delay_buffer_size);
+			add_tap(delay_buffer, delay_buffer_size, read_head,
+			        tap_gains[t], output_left, output_right, chunk_size);
+		}
+	}
+	multitap->path_count[n_taps ? MULTITAP_PATH_FULL : MULTITAP_PATH_DRY]++;
+
+	write_control_output(multitap->latency, 0.0f);
+
+	denormals_restore(fpu_mode);
+	TRACE_END(multitap, n_samples);
+	STATS_END(multitap, n_samples, multitap->path_count, MULTITAP_N_PATHS,
+	          0);
+}
+
+static void
+multitap_cleanup(LV2_Handle instance)
+{
+	MultiTap* multitap = (MultiTap*)instance;
+#ifdef SIMPLE_LV2_TRACING
+	trace_cleanup(&multitap->trace);
+#endif
+	aligned_free(multitap->delay_buffer);
+	aligned_free(instance);
+}
+
+/** The same interfaces for the multi-tap echo */
+SIMPLE_LV2_EXTENSIONS(multitap_, MultiTap, multitap_update_options)
+
+static const LV2_Descriptor multitap_descriptor = {
+	MULTITAP_URI,
+	multitap_instantiate,
+	multitap_connect_port,
+	multitap_activate,
+	multitap_run,
+	deactivate,
+	multitap_cleanup,
+	multitap_extension_data
+};
+
 /**
    The `lv2_descriptor()` function is the entry point to the plugin library.  The
    host will load the library and call this function repeatedly with increasing
@@ -265,6 +1207,7 @@ lv2_descriptor(uint32_t index)
 {
 	switch (index) {
 	case 0:  return &descriptor;
+	case 1:  return &multitap_descriptor;
 	default: return NULL;
 	}
 }
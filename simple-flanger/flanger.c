@@ -15,9 +15,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/** Request POSIX.1-2001 for posix_memalign() */
+#define _POSIX_C_SOURCE 200112L
+
 /** Include standard C headers */
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
    LV2 headers are based on the URI of the specification they come from, so a
@@ -28,6 +32,24 @@
 */
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+/** Host features and options, see `options.h` */
+#include "options.h"
+
+/** Optional run() instrumentation, see `instrumentation.h` */
+#include "instrumentation.h"
+
+/** Optional run() tracing, see `trace.h` */
+#include "trace.h"
+
+/** Options, statistics and worker interfaces, see `extensions.h` */
+#include "extensions.h"
+
+/** Shared DSP building blocks, see `dsp.h` */
+#include "dsp.h"
+
+/** LFO phase offset and transport sync, see `lfo_sync.h` */
+#include "lfo_sync.h"
+
 /**
    The URI is the identifier for a plugin, and how the host associates this
    implementation in code with its description in data.  In this plugin it is
@@ -47,9 +69,26 @@ typedef enum {
 	FLANGER_FEEDBACK = 2,
 	FLANGER_MIX = 3,
 	FLANGER_INPUT  = 4,
-	FLANGER_OUTPUT = 5
+	FLANGER_OUTPUT = 5,
+	FLANGER_PHASE = 6,
+	FLANGER_SYNC = 7,
+	FLANGER_CONTROL = 8,
+	FLANGER_LATENCY = 9,
+	FLANGER_LFO = 10,
+	FLANGER_DELAY_TIME = 11
 } PortIndex;
 
+/**
+   Processing paths selected by run() for each block, depending on parameter
+   values.  The number of blocks processed by each path is counted in the
+   instance.
+*/
+typedef enum {
+	FLANGER_PATH_FULL = 0, // generic processing
+	FLANGER_PATH_DRY  = 1, // mix and feedback are 0, output is attenuated input
+	FLANGER_N_PATHS   = 2
+} ProcessingPath;
+
 /**
    Every plugin defines a private structure for the plugin instance.  All data
    associated with a plugin instance is stored here, and is available to
@@ -60,6 +99,11 @@ typedef enum {
 #define ADDITIONAL_DELAY_MS 1
 
 
+/**
+   Everything touched by run() is grouped at the start of the structure, so it
+   sits in the first cache lines of the (aligned) instance.  Data only used
+   outside of run() goes after it.
+*/
 typedef struct {
 	// Port buffers
 	const float* rate;
@@ -68,20 +112,109 @@ typedef struct {
 	const float* mix;
 	const float* input;
 	float*       output;
-	// Internal data
+	const float* phase;
+	const float* sync;
+	const LV2_Atom_Sequence* control; // NULL if not connected
+	float*       latency; // NULL if not connected
+	float*       lfo; // NULL if not connected
+	float*       delay_time; // NULL if not connected
+	// Internal data used in run()
 	float* delay_buffer;
 	unsigned int delay_buffer_size;
 	unsigned int write_head;
-	float progression;
-	double sampling_rate;
+	uint64_t progression;
+	LfoSync lfo_sync;
+	float delay_offset;    // ADDITIONAL_DELAY_MS in samples
+	float delay_amplitude; // MAX_FLANGER_AMPLITUDE_MS in samples
+	// Scratch buffer, holding the delay in samples of each sample of the
+	// current chunk
+	float* scratch;
+	uint32_t scratch_length;
+	// Cold data
+	InstanceOptions options; // run() only reads the sampling rate
+	LfoSyncURIDs sync_urids;
+	uint32_t path_count[FLANGER_N_PATHS];
+	uint32_t rescue_count; // blocks with non-finite values cleared
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+	SimpleLV2Probe probe;
+#endif
+#ifdef SIMPLE_LV2_TRACING
+	SimpleLV2Trace trace;
+#endif
 } Flanger;
 
+/** Return the delay line size in samples for the sampling rate `rate` */
+static unsigned int
+get_delay_buffer_size(double rate)
+{
+	return (unsigned int)(
+		1 + (MAX_FLANGER_AMPLITUDE_MS + ADDITIONAL_DELAY_MS) * rate / 1000.0f);
+}
+
+/** Clear the processing state, as if nothing had been processed yet */
+static void
+reset(Flanger* flanger)
+{
+	memset(flanger->delay_buffer, 0,
+	       flanger->delay_buffer_size * sizeof(float));
+	flanger->write_head = 0;
+	flanger->progression = 0;
+	lfo_sync_reset(&flanger->lfo_sync);
+}
+
+/**
+   Adapt the instance to new options, see `UpdateOptionsFunction`.  The delay
+   line is sized for the sampling rate, and the scratch buffer for the block
+   lengths.  Buffers that change size are all allocated before any is
+   replaced, so the instance is unchanged if an allocation fails.  A new
+   sampling rate clears the processing state.
+*/
+static uint32_t
+update_options(LV2_Handle instance, const InstanceOptions* options)
+{
+	Flanger* flanger = (Flanger*)instance;
+	const double rate = options->rate;
+	const unsigned int size = get_delay_buffer_size(rate);
+	const uint32_t length = get_scratch_length(options->max_block_length,
+	                                           options->nominal_block_length);
+	void* delay_buffer;
+	void* scratch;
+	if (!replacement_buffer(flanger->delay_buffer,
+	                        flanger->delay_buffer_size * sizeof(float),
+	                        size * sizeof(float), &delay_buffer)) {
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+	if (!replacement_buffer(flanger->scratch,
+	                        flanger->scratch_length * sizeof(float),
+	                        length * sizeof(float), &scratch)) {
+		aligned_free(delay_buffer);
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+
+	if (delay_buffer) {
+		aligned_free(flanger->delay_buffer);
+		flanger->delay_buffer = (float*)delay_buffer;
+		flanger->delay_buffer_size = size;
+	}
+	if (scratch) {
+		aligned_free(flanger->scratch);
+		flanger->scratch = (float*)scratch;
+		flanger->scratch_length = length;
+	}
+	if (rate != flanger->options.rate) {
+		flanger->delay_offset = ADDITIONAL_DELAY_MS * rate / 1000.0;
+		flanger->delay_amplitude = MAX_FLANGER_AMPLITUDE_MS * rate / 1000.0;
+		reset(flanger);
+	}
+	return LV2_OPTIONS_SUCCESS;
+}
+
 /**
    The `instantiate()` function is called by the host to create a new plugin
    instance.  The host passes the plugin descriptor, sample rate, and bundle
    path for plugins that need to load additional resources (e.g. waveforms).
    The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   extensions, this plugin uses the URID map and the options if provided.
 
    This function is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -92,12 +225,26 @@ instantiate(const LV2_Descriptor*     descriptor,
             const char*               bundle_path,
             const LV2_Feature* const* features)
 {
-	Flanger* flanger = (Flanger*)calloc(1, sizeof(Flanger));
-	flanger->sampling_rate = sampling_rate;
-	flanger->delay_buffer_size = 1 + ((MAX_FLANGER_AMPLITUDE_MS
-		+ ADDITIONAL_DELAY_MS) * sampling_rate/1000.0f);
-	flanger->delay_buffer = (float*)calloc(flanger->delay_buffer_size,
-	                                    sizeof(float));
+	Flanger* flanger = (Flanger*)aligned_calloc(sizeof(Flanger));
+	if (!flanger) {
+		return NULL;
+	}
+	const LV2_URID_Map* map =
+		(const LV2_URID_Map*)get_feature(features, LV2_URID__map);
+	if (map) {
+		map_lfo_sync_urids(map, &flanger->sync_urids);
+	}
+	if (!init_instance_options(&flanger->options, flanger, update_options,
+	                           sampling_rate, features)) {
+		aligned_free(flanger->delay_buffer);
+		aligned_free(flanger->scratch);
+		aligned_free(flanger);
+		return NULL;
+	}
+
+#ifdef SIMPLE_LV2_TRACING
+	trace_init(&flanger->trace, "simple-flanger", features);
+#endif
 
 	return (LV2_Handle)flanger;
 }
@@ -123,24 +270,44 @@ connect_port(LV2_Handle instance,
 		break;
 	case FLANGER_DEPTH:
 		flanger->depth = (const float*)data;
+		break;
 	case FLANGER_FEEDBACK:
 		flanger->feedback = (const float*)data;
+		break;
 	case FLANGER_MIX:
 		flanger->mix = (const float*)data;
+		break;
 	case FLANGER_INPUT:
 		flanger->input = (const float*)data;
 		break;
 	case FLANGER_OUTPUT:
 		flanger->output = (float*)data;
 		break;
+	case FLANGER_PHASE:
+		flanger->phase = (const float*)data;
+		break;
+	case FLANGER_SYNC:
+		flanger->sync = (const float*)data;
+		break;
+	case FLANGER_CONTROL:
+		flanger->control = (const LV2_Atom_Sequence*)data;
+		break;
+	case FLANGER_LATENCY:
+		flanger->latency = (float*)data;
+		break;
+	case FLANGER_LFO:
+		flanger->lfo = (float*)data;
+		break;
+	case FLANGER_DELAY_TIME:
+		flanger->delay_time = (float*)data;
+		break;
 	}
 }
 
 /**
    The `activate()` method is called by the host to initialise and prepare the
    plugin instance for running.  The plugin must reset all internal state
-   except for buffer locations set by `connect_port()`.  Since this plugin has
-   no other internal state, this method does nothing.
+   except for buffer locations set by `connect_port()`.
 
    This method is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -148,90 +315,153 @@ connect_port(LV2_Handle instance,
 static void
 activate(LV2_Handle instance)
 {
+	reset((Flanger*)instance);
 }
 
-/** Define a macro for converting a gain in dB to a coefficient. */
-#define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
-
-/** PI constant */
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif//M_PI
-
 /**
-   The `run()` method is the main process function of the plugin.  It processes
-   a block of audio in the audio context.  Since this plugin is
-   `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
-   a mutex) or memory allocation are not allowed.
+   Generic processing, used when no faster path applies.
 */
-static void
-run(LV2_Handle instance, uint32_t n_samples)
+DSP_KERNEL static void
+run_full(Flanger* flanger, uint64_t delta, float depth, float feedback,
+         float mix, uint32_t n_samples)
 {
-	Flanger* flanger = (Flanger*)instance;
-
-	// Port
-	const float rate = *(flanger->rate);
-	const float depth = *(flanger->depth);
-	const float feedback = *(flanger->feedback);
-	const float mix = *(flanger->mix);
 	const float* const input  = flanger->input;
 	float* const       output = flanger->output;
 	// Internal data
 	float * const delay_buffer = flanger->delay_buffer;
+	float * const delay_curve = flanger->scratch;
+	const uint32_t scratch_length = flanger->scratch_length;
 	unsigned int delay_buffer_size = flanger->delay_buffer_size;
-	double sampling_rate = flanger->sampling_rate;
-	float progression = flanger->progression;
+	unsigned int write_head = flanger->write_head;
+	uint64_t progression = flanger->progression;
+
+	// Delay is center +/- swing around the middle of the modulation range
+	float swing = 0.5f * depth * flanger->delay_amplitude;
+	float center = flanger->delay_offset + swing;
+
+	for (uint32_t offset = 0; offset < n_samples;
+	     offset += scratch_length) {
+		uint32_t chunk_size = n_samples - offset;
+		if (chunk_size > scratch_length) {
+			chunk_size = scratch_length;
+		}
 
-	float delta = rate / (float)sampling_rate;
+		// First pass, compute the delay trajectory of the chunk. Phase is
+		// computed from the chunk start so iterations are independent.
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			float delay_in_sample = center +
+				swing * lfo_value(progression, delta, i);
+			delay_curve[i] = fmaxf(delay_in_sample, 1.0f);
+		}
+		progression = lfo_advance(progression, delta, chunk_size);
 
-	for (uint32_t pos = 0; pos < n_samples; pos++) {
-		float input_sample = input[pos];
+		// Second pass, read delay line, write feedback and mix
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			uint32_t pos = offset + i;
+			float input_sample = input[pos];
 
-		float modulant =  0.5f * ( 1.0f +
-			(sinf(2.0f * (float)M_PI * progression)));
-		progression += delta;
-		if (progression > 1.0f) {
-			progression += -1.0f;
-		}
+			float delayed_sample = read_delay_line(
+				delay_buffer, delay_buffer_size, write_head,
+				delay_curve[i]);
+
+			delay_buffer[write_head] = input_sample +
+				delayed_sample * feedback;
+
+			float output_sample =
+				mix_dry_wet(input_sample, delayed_sample, mix);
 
-		float delay_in_sample = ((depth * modulant *
-			(float)MAX_FLANGER_AMPLITUDE_MS) + (float)ADDITIONAL_DELAY_MS) *
-			(float)sampling_rate / 1000.0f;
-		if (delay_in_sample < 1) {
-			delay_in_sample = 1;
+			write_head = ring_advance(write_head, 1, delay_buffer_size);
+			output[pos] = output_sample;
 		}
+	}
+	flanger->write_head = write_head;
+	flanger->progression = progression;
+}
 
-		float delay_in_sample_i; //integral part
-		float delay_in_sample_d; //decimal part
-		delay_in_sample_d = modff(delay_in_sample, &delay_in_sample_i);
+/**
+   Processing when mix and feedback are 0.  Output is the attenuated input, the
+   delay line still records the input and the LFO still runs, so everything is
+   in place when parameters change again.
+*/
+static void
+run_dry(Flanger* flanger, uint64_t delta, uint32_t n_samples)
+{
+	const float* const input  = flanger->input;
+	float* const       output = flanger->output;
 
-		int read_head_a = flanger->write_head - (int)delay_in_sample_i;
-		//int read_head_b = read_head_a - 1;
-		if (read_head_a < 0) read_head_a += delay_buffer_size;
-		int read_head_b = read_head_a - 1;
-		if (read_head_b < 0) read_head_b += delay_buffer_size;
+	flanger->write_head = write_delay_line(flanger->delay_buffer,
+	                                       flanger->delay_buffer_size,
+	                                       flanger->write_head,
+	                                       input,
+	                                       n_samples);
+	flanger->progression = lfo_advance(flanger->progression, delta,
+	                                   n_samples);
+	scale_block(output, input, 0.5f, n_samples);
+}
 
-		//using interpolation to do subsampling delay
-		float sample_a = delay_buffer[read_head_a];
-		float sample_b = delay_buffer[read_head_b];
-		float delayed_sample = (1.0f - delay_in_sample_d) * sample_a + 
-			delay_in_sample_d * sample_b;
+/**
+   The `run()` method is the main process function of the plugin.  It processes
+   a block of audio in the audio context.  Since this plugin is
+   `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
+   a mutex) or memory allocation are not allowed.
+*/
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+	Flanger* flanger = (Flanger*)instance;
+	STATS_BEGIN(flanger);
+	TRACE_BEGIN(flanger);
+	const uint64_t fpu_mode = denormals_disable();
+
+	// Port, clamped to the ranges of flanger.ttl
+	const float rate = sanitize_control(*(flanger->rate), 0.01f, 20.0f, 0.4f);
+	const float depth = sanitize_control(*(flanger->depth), 0.0f, 1.0f, 0.33f);
+	const float feedback =
+		sanitize_control(*(flanger->feedback), -1.0f, 1.0f, -0.75f);
+	const float mix = sanitize_control(*(flanger->mix), 0.0f, 1.0f, 0.66f);
+	const float phase =
+		sanitize_control(*(flanger->phase), 0.0f, 360.0f, 0.0f);
+	const float sync = sanitize_control(*(flanger->sync), 0.0f, 1.0f, 0.0f);
+
+	uint64_t delta = lfo_delta(rate, flanger->options.rate);
+	// LFO phase at the block start, and increment, from the transport when
+	// synced
+	flanger->progression = lfo_sync_phase(&flanger->lfo_sync,
+	                                      &flanger->sync_urids,
+	                                      flanger->control, sync > 0.0f, phase,
+	                                      flanger->progression, &delta);
+
+	if (mix == 0.0f && feedback == 0.0f) {
+		run_dry(flanger, delta, n_samples);
+		flanger->path_count[FLANGER_PATH_DRY]++;
+	} else {
+		run_full(flanger, delta, depth, feedback, mix, n_samples);
+		flanger->path_count[FLANGER_PATH_FULL]++;
+	}
 
-		delay_buffer[flanger->write_head] = input_sample +
-			delayed_sample * feedback;
+	if (rescue_delay_line(flanger->delay_buffer, flanger->delay_buffer_size,
+	                      flanger->write_head, n_samples)) {
+		memset(flanger->output, 0, n_samples * sizeof(float));
+		flanger->rescue_count++;
+	}
 
-		float output_sample = 0.5f * 
-			((1.0f - mix)* input_sample + mix * delayed_sample);
+	lfo_sync_advance(&flanger->lfo_sync, n_samples);
 
-		flanger->write_head++;
-		if (flanger->write_head >= delay_buffer_size) {
-			flanger->write_head -= delay_buffer_size;
-		}
-		output[pos] = output_sample;
-		flanger->progression = progression;
+	write_control_output(flanger->latency, 0.0f);
 
+	// LFO and modulated delay (as in run_full()) at the start of the next
+	// block, for meters
+	const float lfo = lfo_value(flanger->progression, delta, 0);
+	const float swing = 0.5f * depth * flanger->delay_amplitude;
+	write_control_output(flanger->lfo, lfo);
+	write_control_output(flanger->delay_time,
+	                     fmaxf(flanger->delay_offset + swing + swing * lfo,
+	                           1.0f) * 1000.0f / (float)flanger->options.rate);
 
-	}
+	denormals_restore(fpu_mode);
+	TRACE_END(flanger, n_samples);
+	STATS_END(flanger, n_samples, flanger->path_count, FLANGER_N_PATHS,
+	          flanger->rescue_count);
 }
 
 /**
@@ -260,26 +490,17 @@ static void
 cleanup(LV2_Handle instance)
 {
 	Flanger* flanger = (Flanger*)instance;
+#ifdef SIMPLE_LV2_TRACING
+	trace_cleanup(&flanger->trace);
+#endif
 	flanger->delay_buffer_size = 0;
-	free(flanger->delay_buffer);
-	free(instance);
+	aligned_free(flanger->delay_buffer);
+	aligned_free(flanger->scratch);
+	aligned_free(instance);
 }
 
-/**
-   The `extension_data()` function returns any extension data supported by the
-   plugin.  Note that this is not an instance method, but a function on the
-   plugin descriptor.  It is usually used by plugins to implement additional
-   interfaces.  This plugin does not have any extension data, so this function
-   returns NULL.
-
-   This method is in the ``discovery'' threading class, so no other functions
-   or methods in this plugin library will be called concurrently with it.
-*/
-static const void*
-extension_data(const char* uri)
-{
-	return NULL;
-}
+/** Options, statistics and worker interfaces, see `extensions.h` */
+SIMPLE_LV2_EXTENSIONS(, Flanger, update_options)
 
 /**
    Every plugin must define an `LV2_Descriptor`.  It is best to define
@@ -15,9 +15,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/** Request POSIX.1-2001 for posix_memalign() and clock_gettime() */
+#define _POSIX_C_SOURCE 200112L
+
 /** Include standard C headers */
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
    LV2 headers are based on the URI of the specification they come from, so a
@@ -28,6 +32,24 @@
 */
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+/** Host features and options, see `options.h` */
+#include "options.h"
+
+/** Optional run() instrumentation, see `instrumentation.h` */
+#include "instrumentation.h"
+
+/** Optional run() tracing, see `trace.h` */
+#include "trace.h"
+
+/** Options, statistics and worker interfaces, see `extensions.h` */
+#include "extensions.h"
+
+/** Shared DSP building blocks, see `dsp.h` */
+#include "dsp.h"
+
+/** LFO phase offset and transport sync, see `lfo_sync.h` */
+#include "lfo_sync.h"
+
 /**
    The URI is the identifier for a plugin, and how the host associates this
    implementation in code with its description in data.  In this plugin it is
@@ -45,9 +67,26 @@ typedef enum {
 	TREMOLO_DELAY   = 0,
 	TREMOLO_DEPTH = 1,
 	TREMOLO_INPUT  = 2,
-	TREMOLO_OUTPUT = 3
+	TREMOLO_OUTPUT = 3,
+	TREMOLO_PHASE = 4,
+	TREMOLO_SYNC = 5,
+	TREMOLO_CONTROL = 6,
+	TREMOLO_LATENCY = 7,
+	TREMOLO_LFO = 8
 } PortIndex;
 
+/**
+   Processing paths selected by run() for each block, depending on parameter
+   values and port connections.  The number of blocks processed by each path
+   is counted in the instance.
+*/
+typedef enum {
+	TREMOLO_PATH_FULL         = 0, // generic processing
+	TREMOLO_PATH_BYPASS       = 1, // depth is 0, output is a copy of input
+	TREMOLO_PATH_PASS_THROUGH = 2, // as above with in-place ports, no copy
+	TREMOLO_N_PATHS           = 3
+} ProcessingPath;
+
 /**
    Every plugin defines a private structure for the plugin instance.  All data
    associated with a plugin instance is stored here, and is available to
@@ -60,24 +99,77 @@ typedef enum {
 #define MAX_DELAY_IN_SAMPLE 44100  // 1 sec at 44100hz
 #define DELAY_BUFFER_SIZE (MAX_DELAY_IN_SAMPLE + 1)
 
-
 typedef struct {
 	// Port buffers
 	const float* rate;
 	const float* depth;
 	const float* input;
 	float*       output;
+	const float* phase;
+	const float* sync;
+	const LV2_Atom_Sequence* control; // NULL if not connected
+	float*       latency; // NULL if not connected
+	float*       lfo; // NULL if not connected
 	// Internal values
-	float progression;
-	double sample_rate;
+	uint64_t progression;
+	LfoSync lfo_sync;
+	// Scratch buffer, holding the gain of each sample of the current chunk
+	float* scratch;
+	uint32_t scratch_length;
+	InstanceOptions options; // run() only reads the sampling rate
+	LfoSyncURIDs sync_urids;
+	uint32_t path_count[TREMOLO_N_PATHS];
+#ifdef SIMPLE_LV2_INSTRUMENTATION
+	SimpleLV2Probe probe;
+#endif
+#ifdef SIMPLE_LV2_TRACING
+	SimpleLV2Trace trace;
+#endif
 } Tremolo;
 
+/** Clear the processing state, as if nothing had been processed yet */
+static void
+reset(Tremolo* tremolo)
+{
+	tremolo->progression = 0;
+	lfo_sync_reset(&tremolo->lfo_sync);
+}
+
+/**
+   Adapt the instance to new options, see `UpdateOptionsFunction`.  The
+   scratch buffer is sized for the block lengths, the instance is unchanged if
+   its allocation fails.  A new sampling rate clears the processing state.
+*/
+static uint32_t
+update_options(LV2_Handle instance, const InstanceOptions* options)
+{
+	Tremolo* tremolo = (Tremolo*)instance;
+	const uint32_t length = get_scratch_length(options->max_block_length,
+	                                           options->nominal_block_length);
+	void* scratch;
+	if (!replacement_buffer(tremolo->scratch,
+	                        tremolo->scratch_length * sizeof(float),
+	                        length * sizeof(float), &scratch)) {
+		return LV2_OPTIONS_ERR_UNKNOWN;
+	}
+
+	if (scratch) {
+		aligned_free(tremolo->scratch);
+		tremolo->scratch = (float*)scratch;
+		tremolo->scratch_length = length;
+	}
+	if (options->rate != tremolo->options.rate) {
+		reset(tremolo);
+	}
+	return LV2_OPTIONS_SUCCESS;
+}
+
 /**
    The `instantiate()` function is called by the host to create a new plugin
    instance.  The host passes the plugin descriptor, sample_rate, and bundle
    path for plugins that need to load additional resources (e.g. waveforms).
    The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   extensions, this plugin uses the URID map and the options if provided.
 
    This function is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -88,10 +180,27 @@ instantiate(const LV2_Descriptor*     descriptor,
             const char*               bundle_path,
             const LV2_Feature* const* features)
 {
-	Tremolo* tremolo = (Tremolo*)calloc(1, sizeof(Tremolo));
+	Tremolo* tremolo = (Tremolo*)aligned_calloc(sizeof(Tremolo));
+	if (!tremolo) {
+		return NULL;
+	}
 	tremolo->progression=0;
-	tremolo->sample_rate = sample_rate;
 
+	const LV2_URID_Map* map =
+		(const LV2_URID_Map*)get_feature(features, LV2_URID__map);
+	if (map) {
+		map_lfo_sync_urids(map, &tremolo->sync_urids);
+	}
+	if (!init_instance_options(&tremolo->options, tremolo, update_options,
+	                           sample_rate, features)) {
+		aligned_free(tremolo->scratch);
+		aligned_free(tremolo);
+		return NULL;
+	}
+
+#ifdef SIMPLE_LV2_TRACING
+	trace_init(&tremolo->trace, "simple-tremolo", features);
+#endif
 
 	return (LV2_Handle)tremolo;
 }
@@ -117,20 +226,35 @@ connect_port(LV2_Handle instance,
 		break;
 	case TREMOLO_DEPTH:
 		tremolo->depth = (const float*)data;
+		break;
 	case TREMOLO_INPUT:
 		tremolo->input = (const float*)data;
 		break;
 	case TREMOLO_OUTPUT:
 		tremolo->output = (float*)data;
 		break;
+	case TREMOLO_PHASE:
+		tremolo->phase = (const float*)data;
+		break;
+	case TREMOLO_SYNC:
+		tremolo->sync = (const float*)data;
+		break;
+	case TREMOLO_CONTROL:
+		tremolo->control = (const LV2_Atom_Sequence*)data;
+		break;
+	case TREMOLO_LATENCY:
+		tremolo->latency = (float*)data;
+		break;
+	case TREMOLO_LFO:
+		tremolo->lfo = (float*)data;
+		break;
 	}
 }
 
 /**
    The `activate()` method is called by the host to initialise and prepare the
    plugin instance for running.  The plugin must reset all internal state
-   except for buffer locations set by `connect_port()`.  Since this plugin has
-   no other internal state, this method does nothing.
+   except for buffer locations set by `connect_port()`.
 
    This method is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -138,15 +262,54 @@ connect_port(LV2_Handle instance,
 static void
 activate(LV2_Handle instance)
 {
+	reset((Tremolo*)instance);
 }
 
-/** Define a macro for converting a gain in dB to a coefficient. */
-#define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
+/**
+   Generic processing, used when no faster path applies.
+*/
+DSP_KERNEL static void
+run_full(Tremolo* tremolo, float depth, uint64_t delta, uint32_t n_samples)
+{
+	const float* const input  = tremolo->input;
+	float* const       output = tremolo->output;
+	float* const       gain   = tremolo->scratch;
+	const uint32_t scratch_length = tremolo->scratch_length;
+	uint64_t progression = tremolo->progression;
+
+	for (uint32_t offset = 0; offset < n_samples; offset += scratch_length) {
+		uint32_t chunk_size = n_samples - offset;
+		if (chunk_size > scratch_length) {
+			chunk_size = scratch_length;
+		}
+
+		// First pass, compute the LFO gain of the chunk. Phase is computed
+		// from the chunk start so iterations are independent.
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			gain[i] = (1.0f-depth*0.5f) + depth*0.5f *
+				lfo_value(progression, delta, i);
+		}
+		progression = lfo_advance(progression, delta, chunk_size);
 
-/** PI constant */
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif//M_PI
+		// Second pass, apply the gain
+		for (uint32_t i = 0; i < chunk_size; i++) {
+			output[offset + i] = input[offset + i] * gain[i];
+		}
+	}
+	tremolo->progression = progression;
+}
+
+/**
+   Processing with a null depth, output is the input itself.  The LFO still
+   runs so its phase is right when depth is raised again.
+*/
+static void
+run_bypass(Tremolo* tremolo, uint64_t delta, uint32_t n_samples)
+{
+	tremolo->progression = lfo_advance(tremolo->progression, delta,
+	                                   n_samples);
+	copy_block(tremolo->output, tremolo->input, n_samples);
+}
 
 /**
    The `run()` method is the main process function of the plugin.  It processes
@@ -157,31 +320,51 @@ activate(LV2_Handle instance)
 static void
 run(LV2_Handle instance, uint32_t n_samples)
 {
-	//const Tremolo* tremolo = (const Tremolo*)instance;
 	Tremolo* tremolo = (Tremolo*)instance;
-
-	//Port
-	const float        rate   = *(tremolo->rate);
-	const float        depth = *(tremolo->depth);
-	const float* const input  = tremolo->input;
-	float* const       output = tremolo->output;
+	STATS_BEGIN(tremolo);
+	TRACE_BEGIN(tremolo);
+	const uint64_t fpu_mode = denormals_disable();
+
+	//Port, clamped to the ranges of tremolo.ttl
+	const float rate = sanitize_control(*(tremolo->rate), 0.1f, 10.0f, 1.0f);
+	const float depth = sanitize_control(*(tremolo->depth), 0.0f, 1.0f, 0.5f);
+	const float phase =
+		sanitize_control(*(tremolo->phase), 0.0f, 360.0f, 0.0f);
+	const float sync = sanitize_control(*(tremolo->sync), 0.0f, 1.0f, 0.0f);
 	//internal value
-	float progression = tremolo->progression;
-	double sample_rate = tremolo->sample_rate;
-
-	float delta = rate / (float)sample_rate;
-
-	for (uint32_t pos = 0; pos < n_samples; pos++) {
-		float input_sample = input[pos];
-		float modulant = (1.0f-depth*0.5f) + depth*0.5f * (
-			sinf(2.0f * (float)M_PI * progression));
-		output[pos] = input_sample * modulant;
-		progression += delta;
-		if (progression > 1.0f) {
-			progression += -1.0f;
+	double sample_rate = tremolo->options.rate;
+
+	uint64_t delta = lfo_delta(rate, sample_rate);
+	// LFO phase at the block start, and increment, from the transport when
+	// synced
+	tremolo->progression = lfo_sync_phase(&tremolo->lfo_sync,
+	                                      &tremolo->sync_urids,
+	                                      tremolo->control, sync > 0.0f, phase,
+	                                      tremolo->progression, &delta);
+
+	if (depth == 0.0f) {
+		run_bypass(tremolo, delta, n_samples);
+		if (tremolo->output == tremolo->input) {
+			tremolo->path_count[TREMOLO_PATH_PASS_THROUGH]++;
+		} else {
+			tremolo->path_count[TREMOLO_PATH_BYPASS]++;
 		}
+	} else {
+		run_full(tremolo, depth, delta, n_samples);
+		tremolo->path_count[TREMOLO_PATH_FULL]++;
 	}
-	tremolo->progression = progression;
+
+	lfo_sync_advance(&tremolo->lfo_sync, n_samples);
+
+	write_control_output(tremolo->latency, 0.0f);
+
+	// LFO at the start of the next block, for meters
+	write_control_output(tremolo->lfo,
+	                     lfo_value(tremolo->progression, delta, 0));
+
+	denormals_restore(fpu_mode);
+	TRACE_END(tremolo, n_samples);
+	STATS_END(tremolo, n_samples, tremolo->path_count, TREMOLO_N_PATHS, 0);
 }
 
 /**
@@ -210,24 +393,15 @@ static void
 cleanup(LV2_Handle instance)
 {
 	Tremolo* tremolo = (Tremolo*)instance;
-	free(instance);
+#ifdef SIMPLE_LV2_TRACING
+	trace_cleanup(&tremolo->trace);
+#endif
+	aligned_free(tremolo->scratch);
+	aligned_free(instance);
 }
 
-/**
-   The `extension_data()` function returns any extension data supported by the
-   plugin.  Note that this is not an instance method, but a function on the
-   plugin descriptor.  It is usually used by plugins to implement additional
-   interfaces.  This plugin does not have any extension data, so this function
-   returns NULL.
-
-   This method is in the ``discovery'' threading class, so no other functions
-   or methods in this plugin library will be called concurrently with it.
-*/
-static const void*
-extension_data(const char* uri)
-{
-	return NULL;
-}
+/** Options, statistics and worker interfaces, see `extensions.h` */
+SIMPLE_LV2_EXTENSIONS(, Tremolo, update_options)
 
 /**
    Every plugin must define an `LV2_Descriptor`.  It is best to define
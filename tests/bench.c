@@ -0,0 +1,513 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Benchmark of the plugins of a plugin binary, run by `./waf bench`.
+
+   Unlike the tests, it loads the built plugin binary, so it measures the
+   code a host runs, with the flags of the build profile.  Each plugin of the
+   binary runs with each of its settings (see `plugins.h`) at 48 kHz, in
+   blocks of 256 samples, on 10 s of bursts of noise.  The input is
+   connected to each block of the signal instead of being copied, so only
+   `run()` is timed.  The best and median cost per sample of several runs
+   are printed in nanoseconds.
+
+   With `-s` (`./waf bench --scaling`), it also runs 1, 10, 100 and 1000
+   instances of each plugin with its default setting, one block of each in
+   turn like a host does, and prints the best cost per sample and the memory
+   allocated by an instance (the resident set size growth where the C library
+   can't tell).  The cost goes up once the working set of all
+   instances no longer fits in the caches.
+
+   With `-k` (`./waf bench --kernels`), it also times the modulated delay of
+   the chorus and the flanger in two kernel shapes, see `bench_kernels()`.
+
+   Usage: bench [-s] [-k] PLUGIN_BINARY [RUNS]
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <dlfcn.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define BENCH_MALLINFO 1
+#endif
+
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+static LV2_Descriptor_Function bench_lv2_descriptor;
+
+#define test_lv2_descriptor bench_lv2_descriptor
+
+#include "dsp.h"
+#include "harness.h"
+#include "plugins.h"
+
+#define BENCH_RATE         48000.0
+#define BENCH_BLOCK_LENGTH 256
+#define BENCH_SECONDS      10
+#define BENCH_MAX_RUNS     64
+#define BENCH_MAX_INSTANCES 1000
+
+static const TestPlugin* const bench_plugins[] = {
+	&test_chorus, &test_echo, &test_multitap, &test_flanger, &test_tremolo
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/** Return true if the loaded binary contains `plugin` */
+static int
+bench_has(const TestPlugin* plugin)
+{
+	const LV2_Descriptor* descriptor;
+	for (uint32_t i = 0; (descriptor = bench_lv2_descriptor(i)); i++) {
+		if (!strcmp(descriptor->URI, plugin->uri)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+   Memory used by the process in bytes: memory allocated with malloc() if
+   the C library tells, otherwise the resident set size, or 0 if unknown.
+*/
+static size_t
+bench_memory(void)
+{
+#ifdef BENCH_MALLINFO
+	const struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	FILE*         statm = fopen("/proc/self/statm", "r");
+	unsigned long size = 0;
+	unsigned long resident = 0;
+	if (statm) {
+		if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(statm);
+	}
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/**
+   Run `instance` on the `n_samples` of `signal` and return the cost per
+   sample, in nanoseconds.  Outputs are connected by the caller.
+*/
+static double
+bench_run(TestInstance* instance, const float* signal, uint32_t n_samples)
+{
+	const TestPlugin* plugin = instance->plugin;
+	const LV2_Descriptor* d = instance->descriptor;
+	const uint64_t start = bench_now_ns();
+
+	for (uint32_t done = 0; done < n_samples; done += BENCH_BLOCK_LENGTH) {
+		const uint32_t n = n_samples - done < BENCH_BLOCK_LENGTH
+			? n_samples - done : BENCH_BLOCK_LENGTH;
+		for (uint32_t i = 0; i < plugin->n_ports; i++) {
+			const TestPort* port = &plugin->ports[i];
+			if (port->type == TEST_AUDIO_IN && !port->optional) {
+				d->connect_port(instance->handle, port->index,
+				                (void*)(signal + done));
+			}
+		}
+		d->run(instance->handle, n);
+	}
+	return (double)(bench_now_ns() - start) / n_samples;
+}
+
+/** Output buffers, shared by all instances as their output is discarded */
+static float bench_outputs[TEST_MAX_OUTPUTS][BENCH_BLOCK_LENGTH];
+
+/**
+   Instantiate `plugin` with `setting`, connect its outputs and leave its
+   optional inputs unconnected, then activate it.  Return 0 on failure.
+*/
+static int
+bench_start(TestInstance*      instance,
+            const TestPlugin*  plugin,
+            const TestSetting* setting)
+{
+	uint32_t n_outputs = 0;
+
+	if (!test_instantiate(instance, plugin,
+	                      BENCH_RATE, BENCH_BLOCK_LENGTH)) {
+		TEST_CHECK(0, "%s: failed to instantiate", plugin->uri);
+		return 0;
+	}
+	test_apply(instance, setting);
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[i];
+		if (port->type == TEST_AUDIO_IN && port->optional) {
+			instance->descriptor->connect_port(
+				instance->handle, port->index, NULL);
+		} else if (port->type == TEST_AUDIO_OUT) {
+			instance->descriptor->connect_port(
+				instance->handle, port->index, bench_outputs[n_outputs++]);
+		}
+	}
+	instance->descriptor->activate(instance->handle);
+	return 1;
+}
+
+static void
+bench_stop(TestInstance* instance)
+{
+	instance->descriptor->deactivate(instance->handle);
+	test_cleanup(instance);
+}
+
+/** Benchmark `plugin` with `setting`, and print its cost per sample */
+static void
+bench_setting(const TestPlugin*  plugin,
+              const TestSetting* setting,
+              const float*       signal,
+              unsigned           n_runs)
+{
+	const uint32_t n_samples = BENCH_SECONDS * (uint32_t)BENCH_RATE;
+	double costs[BENCH_MAX_RUNS];
+	TestInstance instance;
+
+	if (!bench_start(&instance, plugin, setting)) {
+		return;
+	}
+
+	// A first run warms up caches and branch predictors
+	bench_run(&instance, signal, n_samples);
+	for (unsigned i = 0; i < n_runs; i++) {
+		costs[i] = bench_run(&instance, signal, n_samples);
+	}
+	bench_stop(&instance);
+
+	qsort(costs, n_runs, sizeof(double), test_compare_costs);
+	printf("%-22s %-12s %8.2f %8.2f\n",
+	       strchr(plugin->uri, '#') + 1, setting->name,
+	       costs[0], costs[n_runs / 2]);
+}
+
+/**
+   Run `n_instances` instances of `plugin` with its default setting, one
+   block of each in turn, and print the best cost per sample and the memory
+   used by an instance.
+*/
+static void
+bench_scaling(const TestPlugin* plugin,
+              TestInstance*     instances,
+              unsigned          n_instances,
+              const float*      signal,
+              unsigned          n_runs)
+{
+	// Each instance processes the signal, at least 8 blocks of it
+	const uint32_t n_samples = BENCH_SECONDS * (uint32_t)BENCH_RATE;
+	uint32_t n_blocks = n_samples / BENCH_BLOCK_LENGTH / n_instances;
+	n_blocks = n_blocks < 8 ? 8 : n_blocks;
+
+	const size_t memory = bench_memory();
+	unsigned n_started = 0;
+	while (n_started < n_instances &&
+	       bench_start(&instances[n_started], plugin, &plugin->settings[0])) {
+		n_started++;
+	}
+	const size_t instance_size = (bench_memory() - memory) / n_instances;
+
+	double best = 0.0;
+	for (unsigned run = 0; n_started == n_instances && run <= n_runs; run++) {
+		const uint64_t start = bench_now_ns();
+		for (uint32_t b = 0; b < n_blocks; b++) {
+			const float* input = signal + b * BENCH_BLOCK_LENGTH;
+			for (unsigned i = 0; i < n_instances; i++) {
+				const TestInstance* instance = &instances[i];
+				for (uint32_t p = 0; p < plugin->n_ports; p++) {
+					const TestPort* port = &plugin->ports[p];
+					if (port->type == TEST_AUDIO_IN && !port->optional) {
+						instance->descriptor->connect_port(
+							instance->handle, port->index, (void*)input);
+					}
+				}
+				instance->descriptor->run(instance->handle,
+				                          BENCH_BLOCK_LENGTH);
+			}
+		}
+		const double cost = (double)(bench_now_ns() - start) /
+			((double)n_blocks * BENCH_BLOCK_LENGTH * n_instances);
+
+		// The first run warms up caches and branch predictors
+		if (run == 1 || (run > 1 && cost < best)) {
+			best = cost;
+		}
+	}
+
+	for (unsigned i = 0; i < n_started; i++) {
+		bench_stop(&instances[i]);
+	}
+	if (n_started == n_instances) {
+		printf("%-22s %9u %9.2f %9zu\n",
+		       strchr(plugin->uri, '#') + 1, n_instances, best,
+		       instance_size / 1024);
+	}
+}
+
+/* ==== Kernel shapes ==== */
+
+/**
+   State and settings of a modulated delay, as in the `run_full()` of the
+   chorus and the flanger.  The chorus has no feedback and a delay much longer
+   than the shortest one, so both plugins fit here.
+*/
+typedef struct {
+	const char*  name;
+	float        offset;    // shortest delay of the range, in ms
+	float        amplitude; // modulation range, in ms
+	float        rate;      // LFO frequency, in Hz
+	float        depth;
+	float        feedback;
+	float        mix;
+	float*       delay_buffer;
+	unsigned int delay_buffer_size;
+	unsigned int write_head;
+	uint64_t     progression;
+} BenchModulation;
+
+/** Delay of each sample of a chunk, for the two-pass shape */
+static float bench_delay_curve[BENCH_BLOCK_LENGTH];
+
+/**
+   Process a block in two passes, as the plugins do: compute the delay of each
+   sample of the block from the LFO, then read the delay line along it.
+*/
+DSP_KERNEL static void
+bench_two_pass(BenchModulation* m,
+               const float*     input,
+               float*           output,
+               uint32_t         n_samples)
+{
+	float* const delay_buffer = m->delay_buffer;
+	const unsigned int delay_buffer_size = m->delay_buffer_size;
+	unsigned int write_head = m->write_head;
+	const uint64_t delta = lfo_delta(m->rate, BENCH_RATE);
+	const float swing = 0.5f * m->depth * m->amplitude * BENCH_RATE / 1000.0f;
+	const float center = m->offset * BENCH_RATE / 1000.0f + swing;
+
+	for (uint32_t i = 0; i < n_samples; i++) {
+		bench_delay_curve[i] = fmaxf(
+			center + swing * lfo_value(m->progression, delta, i), 1.0f);
+	}
+	for (uint32_t i = 0; i < n_samples; i++) {
+		const float delayed = read_delay_line(
+			delay_buffer, delay_buffer_size, write_head,
+			bench_delay_curve[i]);
+		delay_buffer[write_head] = input[i] + delayed * m->feedback;
+		output[i] = mix_dry_wet(input[i], delayed, m->mix);
+		write_head = ring_advance(write_head, 1, delay_buffer_size);
+	}
+	m->write_head = write_head;
+	m->progression = lfo_advance(m->progression, delta, n_samples);
+}
+
+/**
+   Process a block in a single loop, as the plugins did before: compute the
+   delay of each sample from the LFO as the delay line is read.
+*/
+DSP_KERNEL static void
+bench_fused(BenchModulation* m,
+            const float*     input,
+            float*           output,
+            uint32_t         n_samples)
+{
+	float* const delay_buffer = m->delay_buffer;
+	const unsigned int delay_buffer_size = m->delay_buffer_size;
+	unsigned int write_head = m->write_head;
+	const uint64_t delta = lfo_delta(m->rate, BENCH_RATE);
+	const float swing = 0.5f * m->depth * m->amplitude * BENCH_RATE / 1000.0f;
+	const float center = m->offset * BENCH_RATE / 1000.0f + swing;
+
+	for (uint32_t i = 0; i < n_samples; i++) {
+		const float delay = fmaxf(
+			center + swing * lfo_value(m->progression, delta, i), 1.0f);
+		const float delayed = read_delay_line(
+			delay_buffer, delay_buffer_size, write_head, delay);
+		delay_buffer[write_head] = input[i] + delayed * m->feedback;
+		output[i] = mix_dry_wet(input[i], delayed, m->mix);
+		write_head = ring_advance(write_head, 1, delay_buffer_size);
+	}
+	m->write_head = write_head;
+	m->progression = lfo_advance(m->progression, delta, n_samples);
+}
+
+typedef void (*BenchKernel)(BenchModulation*, const float*, float*, uint32_t);
+
+/** Run `kernel` on the `n_samples` of `signal`, return the cost per sample */
+static double
+bench_kernel(BenchKernel      kernel,
+             BenchModulation* m,
+             const float*     signal,
+             uint32_t         n_samples)
+{
+	const uint64_t start = bench_now_ns();
+	for (uint32_t done = 0; done < n_samples; done += BENCH_BLOCK_LENGTH) {
+		const uint32_t n = n_samples - done < BENCH_BLOCK_LENGTH
+			? n_samples - done : BENCH_BLOCK_LENGTH;
+		kernel(m, signal + done, bench_outputs[0], n);
+	}
+	return (double)(bench_now_ns() - start) / n_samples;
+}
+
+/**
+   Time the modulated delay of `plugin`, with the settings of `m` (the
+   defaults of the plugin), computed in two passes and in a single loop.  Runs
+   of both shapes alternate, so that they see the same load of the machine.
+   Print the best and median cost per sample of each.
+*/
+static void
+bench_kernels(const TestPlugin* plugin,
+              BenchModulation*  m,
+              const float*      signal,
+              unsigned          n_runs)
+{
+	const uint32_t n_samples = BENCH_SECONDS * (uint32_t)BENCH_RATE;
+	double two_pass[BENCH_MAX_RUNS];
+	double fused[BENCH_MAX_RUNS];
+
+	if (!bench_has(plugin)) {
+		return;
+	}
+	m->delay_buffer_size = (unsigned int)(
+		1 + (m->offset + m->amplitude) * BENCH_RATE / 1000.0f);
+	m->delay_buffer = (float*)aligned_calloc(
+		m->delay_buffer_size * sizeof(float));
+	if (!m->delay_buffer) {
+		TEST_CHECK(0, "%s: failed to allocate a delay line", m->name);
+		return;
+	}
+
+	// A first run of each warms up caches and branch predictors
+	bench_kernel(bench_two_pass, m, signal, n_samples);
+	bench_kernel(bench_fused, m, signal, n_samples);
+	for (unsigned i = 0; i < n_runs; i++) {
+		two_pass[i] = bench_kernel(bench_two_pass, m, signal, n_samples);
+		fused[i] = bench_kernel(bench_fused, m, signal, n_samples);
+	}
+	aligned_free(m->delay_buffer);
+
+	qsort(two_pass, n_runs, sizeof(double), test_compare_costs);
+	qsort(fused, n_runs, sizeof(double), test_compare_costs);
+	printf("%-22s %-12s %8.2f %8.2f\n", m->name, "two passes",
+	       two_pass[0], two_pass[n_runs / 2]);
+	printf("%-22s %-12s %8.2f %8.2f\n", m->name, "fused",
+	       fused[0], fused[n_runs / 2]);
+}
+
+int
+main(int argc, char** argv)
+{
+	int scaling = 0;
+	int kernels = 0;
+	for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+		if (!strcmp(argv[1], "-s")) {
+			scaling = 1;
+		} else if (!strcmp(argv[1], "-k")) {
+			kernels = 1;
+		} else {
+			break;
+		}
+	}
+	if (argc < 2) {
+		fprintf(stderr, "Usage: bench [-s] [-k] PLUGIN_BINARY [RUNS]\n");
+		return EXIT_FAILURE;
+	}
+
+	unsigned n_runs = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 10) : 7;
+	if (n_runs < 1 || n_runs > BENCH_MAX_RUNS) {
+		fprintf(stderr, "error: RUNS must be 1 to %d\n", BENCH_MAX_RUNS);
+		return EXIT_FAILURE;
+	}
+
+	void* binary = dlopen(argv[1], RTLD_NOW | RTLD_LOCAL);
+	if (!binary) {
+		fprintf(stderr, "error: %s\n", dlerror());
+		return EXIT_FAILURE;
+	}
+	*(void**)&bench_lv2_descriptor = dlsym(binary, "lv2_descriptor");
+	if (!bench_lv2_descriptor) {
+		fprintf(stderr, "error: %s has no lv2_descriptor\n", argv[1]);
+		dlclose(binary);
+		return EXIT_FAILURE;
+	}
+
+	const uint32_t n_samples = BENCH_SECONDS * (uint32_t)BENCH_RATE;
+	float* signal = (float*)malloc(n_samples * sizeof(float));
+	test_signal(signal, n_samples);
+
+	printf("%-22s %-12s %8s %8s  (ns/sample, %u runs)\n",
+	       "plugin", "setting", "best", "median", n_runs);
+	for (unsigned i = 0; i < TEST_COUNT(bench_plugins); i++) {
+		const TestPlugin* plugin = bench_plugins[i];
+		if (bench_has(plugin)) {
+			for (uint32_t j = 0; j < plugin->n_settings; j++) {
+				bench_setting(plugin, &plugin->settings[j], signal, n_runs);
+			}
+		}
+	}
+
+	if (scaling) {
+		static const unsigned counts[] = { 1, 10, 100, BENCH_MAX_INSTANCES };
+		TestInstance* instances = (TestInstance*)calloc(
+			BENCH_MAX_INSTANCES, sizeof(TestInstance));
+
+		printf("\n%-22s %9s %9s %9s\n",
+		       "plugin", "instances", "ns/sample", "KiB/inst.");
+		for (unsigned i = 0; i < TEST_COUNT(bench_plugins); i++) {
+			const TestPlugin* plugin = bench_plugins[i];
+			for (unsigned j = 0; bench_has(plugin) && j < TEST_COUNT(counts);
+			     j++) {
+				bench_scaling(plugin, instances, counts[j], signal, n_runs);
+			}
+		}
+		free(instances);
+	}
+
+	if (kernels && (bench_has(&test_chorus) || bench_has(&test_flanger))) {
+		// Default settings of chorus.ttl and flanger.ttl
+		BenchModulation chorus = {
+			"chorus kernel", 10.0f, 30.0f, 0.4f, 0.33f, 0.0f, 0.5f,
+			NULL, 0, 0, 0
+		};
+		BenchModulation flanger = {
+			"flanger kernel", 1.0f, 10.0f, 0.4f, 0.33f, -0.75f, 0.66f,
+			NULL, 0, 0, 0
+		};
+		printf("\n%-22s %-12s %8s %8s  (ns/sample, %u runs)\n",
+		       "kernel", "shape", "best", "median", n_runs);
+		bench_kernels(&test_chorus, &chorus, signal, n_runs);
+		bench_kernels(&test_flanger, &flanger, signal, n_runs);
+	}
+
+	free(signal);
+	dlclose(binary);
+	return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Checks of the test programs.  Checks that fail are printed, and
+   `test_failures` counts them, the test programs exit with a failure status
+   if it isn't 0.
+*/
+
+#ifndef SIMPLE_LV2_TEST_CHECK_H
+#define SIMPLE_LV2_TEST_CHECK_H
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+/** Number of elements of an array */
+#define TEST_COUNT(array) (sizeof(array) / sizeof((array)[0]))
+
+/** Count and print a failure if `cond` is false */
+#define TEST_CHECK(cond, ...) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#endif // SIMPLE_LV2_TEST_CHECK_H
@@ -0,0 +1,39 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Fuzz the flanger, see `fuzz_plugin()`.
+
+   Usage: fuzz_flanger [INSTANCES [RUNS [SEED]]]
+*/
+
+#include "../simple-flanger/flanger.c"
+
+#include "harness.h"
+#include "plugins.h"
+
+int
+main(int argc, char** argv)
+{
+	unsigned n_instances = 40;
+	unsigned n_runs      = 200;
+	uint32_t seed        = 1;
+
+	fuzz_arguments(argc, argv, &n_instances, &n_runs, &seed);
+	fuzz_plugin(&test_flanger, n_instances, n_runs, seed);
+	return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
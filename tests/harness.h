@@ -0,0 +1,1028 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   A minimal LV2 host for the plugin tests.
+
+   Each test program includes the source of one plugin, then this file and
+   `plugins.h`, which describes the ports of every plugin with a `TestPlugin`,
+   the way its Turtle description does, and settings going through each of
+   its processing paths.  The host provides the URID map, the options
+   (sampling rate and block lengths) and `bufsz:boundedBlockLength`, like a
+   typical host.
+
+   `fuzz_plugin()` instantiates a plugin at various sampling rates and block
+   lengths, then runs it with random, extreme and non-finite control values,
+   random block lengths (including 0, 1, odd ones and more than the maximum
+   block length), random transport positions, options changed to valid or
+   invalid values, and in-place or separate buffers, with ports connected in
+   a random order.  Audio buffers are allocated for each run with the exact
+   block length, so that a build with `--sanitize` catches any access out of
+   them.  Besides crashes and sanitizer errors, it checks that outputs are
+   finite while the input is, and that no kind of input (non-finite, huge,
+   denormal or silent) makes `run()` much slower than usual.
+
+   `check_in_place()` checks that a plugin gives the same output with shared
+   and separate input and output buffers, and `check_latency()` that an
+   impulse comes out after the latency the plugin reports.
+
+   Checks that fail are printed and counted, see `check.h`.
+*/
+
+#ifndef SIMPLE_LV2_TEST_HARNESS_H
+#define SIMPLE_LV2_TEST_HARNESS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/parameters/parameters.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#include "check.h"
+
+/** Most ports a plugin can have */
+#define TEST_MAX_PORTS 32
+
+/** Most URIs the host can map */
+#define TEST_MAX_URIDS 64
+
+/** Most audio outputs a plugin can have */
+#define TEST_MAX_OUTPUTS 2
+
+/** Most control values of a setting */
+#define TEST_MAX_CONTROLS 8
+
+/** Size of the atom sequence buffer of atom input ports */
+#define TEST_ATOM_SIZE 256
+
+/** Shortest block whose processing time is checked by `fuzz_plugin()` */
+#define TEST_TIMED_LENGTH 1024
+
+/** Timed blocks of each kind of input, see `test_check_costs()` */
+#define TEST_TIMED_RUNS 5
+
+/** Most a kind of input may slow `run()` down, against noise */
+#define TEST_MAX_SLOWDOWN 10.0
+
+typedef enum {
+	TEST_AUDIO_IN,
+	TEST_AUDIO_OUT,
+	TEST_CONTROL_IN,
+	TEST_CONTROL_OUT,
+	TEST_ATOM_IN
+} TestPortType;
+
+/** Kinds of random input, see `test_audio()` */
+typedef enum {
+	TEST_INPUT_NAN,
+	TEST_INPUT_INFINITE,
+	TEST_INPUT_HUGE,
+	TEST_INPUT_DENORMAL,
+	TEST_INPUT_SILENT,
+	TEST_INPUT_NOISE,
+	TEST_N_INPUTS
+} TestInput;
+
+/** A port, as described in the plugin Turtle file */
+typedef struct {
+	uint32_t     index;
+	TestPortType type;
+	float        minimum; // control inputs only
+	float        maximum;
+	float        value;   // default
+	int          optional; // lv2:connectionOptional
+} TestPort;
+
+/** Control values of a setting, other controls have their default */
+typedef struct {
+	const char* name;
+	uint32_t    n_controls;
+	struct {
+		uint32_t index;
+		float    value;
+	} controls[TEST_MAX_CONTROLS];
+} TestSetting;
+
+/**
+   A plugin, as described in the plugin Turtle file, and settings going
+   through each of its processing paths, the first one being the default.
+*/
+typedef struct {
+	const char*        uri;
+	const TestPort*    ports;
+	uint32_t           n_ports;
+	uint32_t           latency; // index of the lv2:reportsLatency port
+	const TestSetting* settings;
+	uint32_t           n_settings;
+} TestPlugin;
+
+/** A plugin instance and the buffers connected to its ports */
+typedef struct {
+	const LV2_Descriptor* descriptor;
+	const TestPlugin*     plugin;
+	LV2_Handle            handle;
+	float                 controls[TEST_MAX_PORTS];
+	float*                audio[TEST_MAX_PORTS];
+	uint64_t              atom[TEST_ATOM_SIZE / sizeof(uint64_t)];
+} TestInstance;
+
+/* ==== Host features ==== */
+
+static char test_uris[TEST_MAX_URIDS][128];
+static int  test_n_uris = 0;
+
+static LV2_URID
+test_map(LV2_URID_Map_Handle handle, const char* uri)
+{
+	(void)handle;
+	for (int i = 0; i < test_n_uris; i++) {
+		if (!strcmp(test_uris[i], uri)) {
+			return (LV2_URID)i + 1;
+		}
+	}
+	if (test_n_uris == TEST_MAX_URIDS || strlen(uri) >= 128) {
+		return 0;
+	}
+	strcpy(test_uris[test_n_uris], uri);
+	return (LV2_URID)++test_n_uris;
+}
+
+static LV2_URID_Map test_urid_map = { NULL, test_map };
+
+#define TEST_URID(uri) test_map(NULL, (uri))
+
+/** Options and features given to `instantiate()` */
+typedef struct {
+	float              sample_rate;
+	int32_t            max_block_length;
+	int32_t            nominal_block_length;
+	LV2_Options_Option options[4];
+	LV2_Feature        map_feature;
+	LV2_Feature        options_feature;
+	LV2_Feature        bounded_feature;
+	const LV2_Feature* features[4];
+} TestFeatures;
+
+/**
+   Set up the features of a host running at `rate`, with blocks of at most
+   `max_block_length` samples, or unknown lengths if 0.
+*/
+static inline const LV2_Feature* const*
+test_features(TestFeatures* f, double rate, int32_t max_block_length)
+{
+	const LV2_URID atom_Float = TEST_URID(LV2_ATOM__Float);
+	const LV2_URID atom_Int = TEST_URID(LV2_ATOM__Int);
+	int n = 0;
+
+	memset(f, 0, sizeof(*f));
+	f->sample_rate = (float)rate;
+	f->max_block_length = max_block_length;
+	f->nominal_block_length = max_block_length;
+	f->options[n++] = (LV2_Options_Option){
+		LV2_OPTIONS_INSTANCE, 0, TEST_URID(LV2_PARAMETERS__sampleRate),
+		sizeof(float), atom_Float, &f->sample_rate };
+	if (max_block_length > 0) {
+		f->options[n++] = (LV2_Options_Option){
+			LV2_OPTIONS_INSTANCE, 0, TEST_URID(LV2_BUF_SIZE__maxBlockLength),
+			sizeof(int32_t), atom_Int, &f->max_block_length };
+		f->options[n++] = (LV2_Options_Option){
+			LV2_OPTIONS_INSTANCE, 0,
+			TEST_URID(LV2_BUF_SIZE__nominalBlockLength),
+			sizeof(int32_t), atom_Int, &f->nominal_block_length };
+	}
+
+	f->map_feature = (LV2_Feature){ LV2_URID__map, &test_urid_map };
+	f->options_feature = (LV2_Feature){ LV2_OPTIONS__options, f->options };
+	f->bounded_feature =
+		(LV2_Feature){ LV2_BUF_SIZE__boundedBlockLength, NULL };
+	f->features[0] = &f->map_feature;
+	f->features[1] = &f->options_feature;
+	f->features[2] = max_block_length > 0 ? &f->bounded_feature : NULL;
+	f->features[3] = NULL;
+	return f->features;
+}
+
+/* ==== Instances ==== */
+
+/**
+   Descriptor function of the plugin binary: the one of the plugin source the
+   test program includes, unless the program defines another one, e.g. of a
+   plugin binary it loads.
+*/
+#ifndef test_lv2_descriptor
+#define test_lv2_descriptor lv2_descriptor
+#endif
+
+/** Return the descriptor of `plugin` in the plugin binary */
+static inline const LV2_Descriptor*
+test_descriptor(const TestPlugin* plugin)
+{
+	const LV2_Descriptor* descriptor;
+	for (uint32_t i = 0; (descriptor = test_lv2_descriptor(i)); i++) {
+		if (!strcmp(descriptor->URI, plugin->uri)) {
+			return descriptor;
+		}
+	}
+	fprintf(stderr, "error: no descriptor for <%s>\n", plugin->uri);
+	exit(EXIT_FAILURE);
+}
+
+/** Set every control input of `instance` to its default value */
+static inline void
+test_defaults(TestInstance* instance)
+{
+	for (uint32_t i = 0; i < instance->plugin->n_ports; i++) {
+		const TestPort* port = &instance->plugin->ports[i];
+		instance->controls[port->index] = port->value;
+	}
+}
+
+/** Connect a control or atom port to the buffers of `instance` */
+static inline void
+test_connect_control(TestInstance* instance, const TestPort* port)
+{
+	const LV2_Descriptor* d = instance->descriptor;
+	if (port->type == TEST_ATOM_IN) {
+		LV2_Atom_Sequence* seq = (LV2_Atom_Sequence*)instance->atom;
+		seq->atom.size = sizeof(LV2_Atom_Sequence_Body);
+		seq->atom.type = TEST_URID(LV2_ATOM__Sequence);
+		seq->body.unit = 0;
+		seq->body.pad = 0;
+		d->connect_port(instance->handle, port->index, seq);
+	} else if (port->type == TEST_CONTROL_IN ||
+	           port->type == TEST_CONTROL_OUT) {
+		d->connect_port(instance->handle, port->index,
+		                &instance->controls[port->index]);
+	}
+}
+
+static inline uint32_t test_random(void); // see below
+
+/**
+   Write the positions in `plugin->ports` of its ports to `order`, in a random
+   order, as a host may connect them in any order.
+*/
+static inline void
+test_port_order(const TestPlugin* plugin, uint32_t* order)
+{
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const uint32_t j = test_random() % (i + 1);
+		order[i] = order[j];
+		order[j] = i;
+	}
+}
+
+/**
+   Instantiate `plugin` at `rate` with default controls, and connect its
+   control ports in a random order.  Audio ports are connected by the caller.
+   Return 0 if instantiation failed.
+*/
+static inline int
+test_instantiate(TestInstance*     instance,
+                 const TestPlugin* plugin,
+                 double            rate,
+                 int32_t           max_block_length)
+{
+	TestFeatures features;
+
+	memset(instance, 0, sizeof(*instance));
+	instance->plugin = plugin;
+	instance->descriptor = test_descriptor(plugin);
+	instance->handle = instance->descriptor->instantiate(
+		instance->descriptor, rate, "",
+		test_features(&features, rate, max_block_length));
+	if (!instance->handle) {
+		return 0;
+	}
+	uint32_t order[TEST_MAX_PORTS];
+	test_port_order(plugin, order);
+	test_defaults(instance);
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		test_connect_control(instance, &plugin->ports[order[i]]);
+	}
+	return 1;
+}
+
+static inline void
+test_cleanup(TestInstance* instance)
+{
+	instance->descriptor->cleanup(instance->handle);
+	instance->handle = NULL;
+}
+
+/* ==== Processing ==== */
+
+/** Set the controls of `instance` to their default, then to `setting` */
+static inline void
+test_apply(TestInstance* instance, const TestSetting* setting)
+{
+	test_defaults(instance);
+	for (uint32_t i = 0; i < setting->n_controls; i++) {
+		instance->controls[setting->controls[i].index] =
+			setting->controls[i].value;
+	}
+}
+
+/**
+   Run `instance` on the `n_samples` of `input`, in blocks of `block_length`,
+   and write its audio outputs to `outputs`.  Each block gets new buffers of
+   exactly its length.  If `in_place` isn't 0, output number `in_place` - 1
+   is connected to the input buffer.  Optional audio inputs are not
+   connected.
+*/
+static inline void
+test_process(TestInstance* instance,
+             const float*  input,
+             float* const* outputs,
+             uint32_t      n_samples,
+             uint32_t      block_length,
+             uint32_t      in_place)
+{
+	const TestPlugin* plugin = instance->plugin;
+	const LV2_Descriptor* d = instance->descriptor;
+	float* in = (float*)malloc(block_length * sizeof(float));
+	float* out[TEST_MAX_OUTPUTS];
+	uint32_t n_outputs = 0;
+
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[i];
+		if (port->type == TEST_AUDIO_IN) {
+			d->connect_port(instance->handle, port->index,
+			                port->optional ? NULL : in);
+		} else if (port->type == TEST_AUDIO_OUT) {
+			out[n_outputs] = in_place == n_outputs + 1
+				? in : (float*)malloc(block_length * sizeof(float));
+			d->connect_port(instance->handle, port->index, out[n_outputs]);
+			n_outputs++;
+		}
+	}
+
+	for (uint32_t done = 0; done < n_samples; done += block_length) {
+		const uint32_t n = n_samples - done < block_length
+			? n_samples - done : block_length;
+		memcpy(in, input + done, n * sizeof(float));
+		d->run(instance->handle, n);
+		for (uint32_t i = 0; i < n_outputs; i++) {
+			memcpy(outputs[i] + done, out[i], n * sizeof(float));
+		}
+	}
+
+	for (uint32_t i = 0; i < n_outputs; i++) {
+		if (out[i] != in) {
+			free(out[i]);
+		}
+	}
+	free(in);
+}
+
+/* ==== Random values ==== */
+
+static uint32_t test_random_state = 1;
+
+static inline uint32_t
+test_random(void)
+{
+	// xorshift32, deterministic for a given seed
+	uint32_t x = test_random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return test_random_state = x;
+}
+
+/** Uniform random number in [min, max] */
+static inline float
+test_uniform(float min, float max)
+{
+	return min + (max - min) * (float)(test_random() >> 8) / 16777215.0f;
+}
+
+/** Random value for a control input, often out of range or not finite */
+static inline float
+test_random_control(const TestPort* port)
+{
+	const float range = port->maximum - port->minimum;
+	switch (test_random() % 12) {
+	case 0: return port->minimum;
+	case 1: return port->maximum;
+	case 2: return port->value;
+	case 3: return port->minimum - test_uniform(0.0f, 10.0f * range + 1.0f);
+	case 4: return port->maximum + test_uniform(0.0f, 10.0f * range + 1.0f);
+	case 5: return NAN;
+	case 6: return INFINITY;
+	case 7: return -INFINITY;
+	case 8: return (test_random() & 1) ? 1e30f : -1e30f;
+	case 9: return 1e-40f; // denormal
+	default: return test_uniform(port->minimum, port->maximum);
+	}
+}
+
+/** Random block length, up to about twice `max_block_length` */
+static inline uint32_t
+test_random_length(int32_t max_block_length)
+{
+	const uint32_t max = max_block_length > 0 ? (uint32_t)max_block_length
+	                                          : 4096;
+	switch (test_random() % 8) {
+	case 0: return 0;
+	case 1: return 1;
+	case 2: return max;
+	case 3: return max + 1 + test_random() % (max + 1); // more than allowed
+	case 4: return (test_random() % max) | 1;           // odd
+	default: return test_random() % (max + 1);
+	}
+}
+
+/**
+   Fill `buffer` with bursts of noise separated by silences, so that the
+   processing of silence and tails is exercised too.  The signal is the same
+   on each call.
+*/
+static inline void
+test_signal(float* buffer, uint32_t n_samples)
+{
+	test_random_state = 1;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		buffer[i] = (i % 6000 < 2000) ? test_uniform(-1.0f, 1.0f) : 0.0f;
+	}
+}
+
+/**
+   Fill `buffer` with noise of `kind`: with a sample that isn't finite or is
+   huge, denormal noise, silence or plain noise.
+*/
+static inline void
+test_audio(float* buffer, uint32_t n_samples, TestInput kind)
+{
+	const float scale = kind == TEST_INPUT_DENORMAL ? 1e-40f
+		: kind == TEST_INPUT_SILENT ? 0.0f : 1.0f;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		buffer[i] = scale * test_uniform(-1.0f, 1.0f);
+	}
+	if (n_samples > 0 && kind <= TEST_INPUT_HUGE) {
+		const float values[] = { NAN, INFINITY, 1e30f };
+		buffer[test_random() % n_samples] = (kind == 0 || test_random() & 1)
+			? values[kind] : -values[kind];
+	}
+}
+
+/**
+   Fill `buffer` with noise, once in a while of another kind (see
+   `test_audio()`).  Return 0 if some samples aren't finite.
+*/
+static inline int
+test_random_audio(float* buffer, uint32_t n_samples)
+{
+	const uint32_t kind = test_random() % 16;
+	test_audio(buffer, n_samples,
+	           kind < TEST_INPUT_NOISE ? (TestInput)kind : TEST_INPUT_NOISE);
+	return n_samples == 0 ||
+		(kind != TEST_INPUT_NAN && kind != TEST_INPUT_INFINITE);
+}
+
+/**
+   Write a sequence with a random `time:Position` to the atom buffer of
+   `instance`, possibly with a non-finite speed or an unusual frame.
+*/
+static inline void
+test_random_position(TestInstance* instance, uint32_t n_samples)
+{
+	LV2_Atom_Sequence* seq = (LV2_Atom_Sequence*)instance->atom;
+	LV2_Atom_Event* ev = (LV2_Atom_Event*)(seq + 1);
+	LV2_Atom_Object* object = (LV2_Atom_Object*)&ev->body;
+	LV2_Atom_Property_Body* prop = (LV2_Atom_Property_Body*)(object + 1);
+	const float speeds[] = { 0.0f, 1.0f, -1.0f, 2.0f, NAN, INFINITY, 1e30f };
+	const int64_t frames[] = {
+		0, 48000, -1, INT64_MAX, INT64_MIN, (int64_t)test_random() << 20
+	};
+
+	ev->time.frames = n_samples ? test_random() % n_samples : 0;
+	object->atom.type = TEST_URID(LV2_ATOM__Object);
+	object->body.id = 0;
+	object->body.otype = TEST_URID(LV2_TIME__Position);
+
+	// time:speed, a float padded to 8 bytes
+	prop->key = TEST_URID(LV2_TIME__speed);
+	prop->context = 0;
+	prop->value.size = sizeof(float);
+	prop->value.type = TEST_URID(LV2_ATOM__Float);
+	*(float*)(prop + 1) = speeds[test_random() % 7];
+	prop = (LV2_Atom_Property_Body*)((uint8_t*)(prop + 1) + 8);
+
+	// time:frame
+	prop->key = TEST_URID(LV2_TIME__frame);
+	prop->context = 0;
+	prop->value.size = sizeof(int64_t);
+	prop->value.type = TEST_URID(LV2_ATOM__Long);
+	*(int64_t*)(prop + 1) = frames[test_random() % 6];
+	prop = (LV2_Atom_Property_Body*)((uint8_t*)(prop + 1) + 8);
+
+	object->atom.size = (uint32_t)((uint8_t*)prop - (uint8_t*)&object->body);
+	seq->atom.size = (uint32_t)(sizeof(LV2_Atom_Sequence_Body) +
+	                            sizeof(LV2_Atom_Event) + object->atom.size);
+}
+
+/* ==== Fuzzing ==== */
+
+/** Sampling rates tried, including unusual ones */
+static const double test_rates[] = {
+	8000.0, 22050.0, 44100.0, 48000.0, 88200.0, 96000.0, 192000.0, 384000.0,
+	1.0, 768000.0
+};
+
+/** Maximum block lengths tried, 0 for none */
+static const int32_t test_block_lengths[] = { 0, 1, 7, 64, 256, 4096, 8192 };
+
+/** Option values that aren't finite or are out of range for any option */
+static const float test_bad_option_values[] = {
+	NAN, INFINITY, -INFINITY, -48000.0f, -1.0f, 0.5f, 1e30f, 3e9f
+};
+
+/**
+   Change the options of a running instance, if it supports that, sometimes
+   to values it must reject.  Check that the instance then keeps a usable
+   sampling rate.
+*/
+static inline void
+test_random_options(TestInstance* instance)
+{
+	const LV2_Options_Interface* iface = (const LV2_Options_Interface*)
+		instance->descriptor->extension_data(LV2_OPTIONS__interface);
+	if (!iface) {
+		return;
+	}
+	const uint32_t n_bad = (uint32_t)TEST_COUNT(test_bad_option_values);
+	float rate = test_random() % 4
+		? (float)test_rates[test_random() % 8]
+		: test_bad_option_values[test_random() % n_bad];
+	float length = test_random() % 4
+		? (float)test_block_lengths[test_random() % 7]
+		: test_bad_option_values[test_random() % n_bad];
+	const LV2_Options_Option options[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, TEST_URID(LV2_PARAMETERS__sampleRate),
+		  sizeof(float), TEST_URID(LV2_ATOM__Float), &rate },
+		{ LV2_OPTIONS_INSTANCE, 0, TEST_URID(LV2_BUF_SIZE__maxBlockLength),
+		  sizeof(float), TEST_URID(LV2_ATOM__Float), &length },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	iface->set(instance->handle, options);
+
+	LV2_Options_Option current[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, TEST_URID(LV2_PARAMETERS__sampleRate),
+		  0, 0, NULL },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	if (iface->get(instance->handle, current) == LV2_OPTIONS_SUCCESS &&
+	    current[0].type == TEST_URID(LV2_ATOM__Double)) {
+		const double value = *(const double*)current[0].value;
+		TEST_CHECK(value >= 1.0 && value <= 768000.0,
+		           "%s: sampling rate %g after setting %g",
+		           instance->plugin->uri, value, (double)rate);
+	}
+}
+
+/**
+   Run one block of `n_samples` random samples through `instance`, with new
+   audio buffers, input and output possibly being the same, and ports
+   connected in a random order.  Return 0 if the input had non-finite
+   samples.
+*/
+static inline int
+test_random_run(TestInstance* instance, uint32_t n_samples)
+{
+	const TestPlugin* plugin = instance->plugin;
+	const LV2_Descriptor* d = instance->descriptor;
+	float* input = NULL;
+	int finite = 1;
+	uint32_t order[TEST_MAX_PORTS];
+
+	test_port_order(plugin, order);
+
+	// New input buffers of exactly n_samples, optional ones may be missing
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[i];
+		float** buffer = &instance->audio[port->index];
+		if (port->type != TEST_AUDIO_IN && port->type != TEST_AUDIO_OUT) {
+			continue;
+		}
+		free(*buffer);
+		*buffer = NULL;
+		if (port->optional && test_random() % 4 == 0) {
+			d->connect_port(instance->handle, port->index, NULL);
+			continue;
+		}
+		*buffer = (float*)malloc((n_samples ? n_samples : 1) * sizeof(float));
+		if (port->type == TEST_AUDIO_IN) {
+			finite &= test_random_audio(*buffer, n_samples);
+			if (!input) {
+				input = *buffer;
+			}
+		}
+	}
+
+	// One output may be connected to the main input instead (in-place)
+	const int in_place = input && test_random() % 2;
+	const TestPort* in_place_port = NULL;
+	for (uint32_t i = 0; in_place && i < plugin->n_ports; i++) {
+		if (plugin->ports[i].type == TEST_AUDIO_OUT) {
+			in_place_port = &plugin->ports[i];
+			break;
+		}
+	}
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[order[i]];
+		float* buffer = port == in_place_port
+			? input : instance->audio[port->index];
+		if (buffer && (port->type == TEST_AUDIO_IN ||
+		               port->type == TEST_AUDIO_OUT)) {
+			d->connect_port(instance->handle, port->index, buffer);
+		}
+	}
+
+	// Random control values and transport positions
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[order[i]];
+		if (port->type == TEST_CONTROL_IN && test_random() % 4 == 0) {
+			instance->controls[port->index] = test_random_control(port);
+		} else if (port->type == TEST_ATOM_IN) {
+			test_connect_control(instance, port);
+			if (test_random() % 8 == 0) {
+				test_random_position(instance, n_samples);
+			} else if (test_random() % 8 == 0) {
+				d->connect_port(instance->handle, port->index, NULL);
+			}
+		}
+	}
+
+	d->run(instance->handle, n_samples);
+
+	// With in-place ports, the output the checks read is the input buffer
+	if (in_place_port) {
+		float** buffer = &instance->audio[in_place_port->index];
+		*buffer = (float*)realloc(*buffer,
+		                          (n_samples ? n_samples : 1) * sizeof(float));
+		memcpy(*buffer, input, n_samples * sizeof(float));
+	}
+	return finite;
+}
+
+/** Check that the outputs of the last run of `n_samples` are finite */
+static inline void
+test_check_finite(const TestInstance* instance, uint32_t n_samples)
+{
+	const TestPlugin* plugin = instance->plugin;
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[i];
+		if (port->type == TEST_CONTROL_OUT) {
+			const float value = instance->controls[port->index];
+			TEST_CHECK(isfinite(value), "%s: output port %u is %g",
+			           plugin->uri, port->index, value);
+		} else if (port->type == TEST_AUDIO_OUT) {
+			const float* output = instance->audio[port->index];
+			for (uint32_t j = 0; j < n_samples; j++) {
+				if (!isfinite(output[j])) {
+					TEST_CHECK(0, "%s: output port %u is %g at %u",
+					           plugin->uri, port->index, output[j], j);
+					break;
+				}
+			}
+		}
+	}
+}
+
+/** Return the current time, in nanoseconds */
+static inline double
+test_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static inline int
+test_compare_costs(const void* a, const void* b)
+{
+	const double x = *(const double*)a;
+	const double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+   Check that no kind of input makes a run of `instance` much slower than
+   noise, with each setting of the plugin, in blocks of `n_samples`.  Runs of
+   each kind of input are timed in turn, and the median cost per sample of
+   each kind is compared with that of noise, so that a run preempted by the
+   system doesn't fail the check.  Noise runs following a non-finite input
+   also catch a processing slowed down by its state.
+*/
+static inline void
+test_check_costs(TestInstance* instance, uint32_t n_samples)
+{
+	static const char* const names[] = {
+		"NaN", "infinite", "huge", "denormal", "silent", "noise"
+	};
+	const TestPlugin* plugin = instance->plugin;
+	const LV2_Descriptor* d = instance->descriptor;
+	float* buffers[TEST_MAX_PORTS] = { NULL };
+	double costs[TEST_N_INPUTS][TEST_TIMED_RUNS];
+
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		const TestPort* port = &plugin->ports[i];
+		if (port->type == TEST_AUDIO_IN || port->type == TEST_AUDIO_OUT) {
+			buffers[i] = (float*)malloc(n_samples * sizeof(float));
+			d->connect_port(instance->handle, port->index, buffers[i]);
+		} else {
+			test_connect_control(instance, port);
+		}
+	}
+
+	for (uint32_t s = 0; s < plugin->n_settings; s++) {
+		const TestSetting* setting = &plugin->settings[s];
+		test_apply(instance, setting);
+		for (uint32_t r = 0; r < TEST_TIMED_RUNS; r++) {
+			for (int kind = 0; kind < TEST_N_INPUTS; kind++) {
+				for (uint32_t i = 0; i < plugin->n_ports; i++) {
+					if (plugin->ports[i].type == TEST_AUDIO_IN) {
+						test_audio(buffers[i], n_samples, (TestInput)kind);
+					}
+				}
+				const double start = test_now_ns();
+				d->run(instance->handle, n_samples);
+				costs[kind][r] = (test_now_ns() - start) / n_samples;
+			}
+		}
+
+		for (int kind = 0; kind < TEST_N_INPUTS; kind++) {
+			qsort(costs[kind], TEST_TIMED_RUNS, sizeof(double),
+			      test_compare_costs);
+		}
+		const double noise = costs[TEST_INPUT_NOISE][TEST_TIMED_RUNS / 2];
+		for (int kind = 0; kind < TEST_INPUT_NOISE; kind++) {
+			const double cost = costs[kind][TEST_TIMED_RUNS / 2];
+			TEST_CHECK(cost <= TEST_MAX_SLOWDOWN * noise,
+			           "%s (%s, blocks of %u): %.1f ns/sample with %s input, "
+			           "%.1f times as long as with noise",
+			           plugin->uri, setting->name, n_samples, cost,
+			           names[kind], cost / noise);
+		}
+	}
+
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		free(buffers[i]);
+	}
+}
+
+/**
+   Fuzz `plugin` with `n_instances` instances of `n_runs` runs each, from
+   random `seed`.
+*/
+static inline void
+fuzz_plugin(const TestPlugin* plugin,
+            unsigned          n_instances,
+            unsigned          n_runs,
+            uint32_t          seed)
+{
+	const int failures = test_failures;
+
+	test_random_state = seed ? seed : 1;
+	for (unsigned i = 0; i < n_instances; i++) {
+		const int32_t max_length = test_block_lengths[test_random() % 7];
+		const double rate = test_rates[i % 10];
+		TestInstance instance;
+		if (!test_instantiate(&instance, plugin, rate, max_length)) {
+			// Only unusable sampling rates may fail
+			TEST_CHECK(rate < 1000.0,
+			           "%s: failed to instantiate at %g Hz",
+			           plugin->uri, rate);
+			continue;
+		}
+		const LV2_Descriptor* d = instance.descriptor;
+		int finite = 1; // no non-finite input since activation
+
+		d->activate(instance.handle);
+		for (unsigned j = 0; j < n_runs; j++) {
+			switch (test_random() % 64) {
+			case 0:
+				d->deactivate(instance.handle);
+				d->activate(instance.handle);
+				finite = 1;
+				break;
+			case 1:
+				test_random_options(&instance);
+				break;
+			case 2:
+				test_defaults(&instance);
+				break;
+			default:
+				break;
+			}
+			const uint32_t n_samples = test_random_length(max_length);
+			finite &= test_random_run(&instance, n_samples);
+			if (finite) {
+				test_check_finite(&instance, n_samples);
+			}
+
+			if (test_failures > failures) {
+				fprintf(stderr, "%s: seed %u, instance %u, run %u\n",
+				        plugin->uri, seed, i, j);
+				break;
+			}
+		}
+		// With the state the runs left, in blocks as long as allowed
+		const uint32_t timed_length = max_length > 0 ? (uint32_t)max_length
+		                                             : 4096;
+		if (test_failures == failures && timed_length >= TEST_TIMED_LENGTH) {
+			test_check_costs(&instance, timed_length);
+			if (test_failures > failures) {
+				fprintf(stderr, "%s: seed %u, instance %u\n",
+				        plugin->uri, seed, i);
+			}
+		}
+		d->deactivate(instance.handle);
+		for (uint32_t k = 0; k < TEST_MAX_PORTS; k++) {
+			free(instance.audio[k]);
+		}
+		test_cleanup(&instance);
+		if (test_failures > failures) {
+			return;
+		}
+	}
+}
+
+/**
+   Parse the arguments of a fuzzing program: number of instances, runs per
+   instance and random seed, all optional.
+*/
+static inline void
+fuzz_arguments(int       argc,
+               char**    argv,
+               unsigned* n_instances,
+               unsigned* n_runs,
+               uint32_t* seed)
+{
+	if (argc > 1) {
+		*n_instances = (unsigned)strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		*n_runs = (unsigned)strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		*seed = (uint32_t)strtoul(argv[3], NULL, 10);
+	}
+}
+
+/* ==== In-place processing ==== */
+
+/**
+   Check that `plugin` with `setting` gives the same output when its input and
+   any of its outputs share a buffer as with separate buffers, as it isn't
+   lv2:inPlaceBroken.
+*/
+static inline void
+check_in_place(const TestPlugin* plugin, const TestSetting* setting)
+{
+	static const uint32_t lengths[] = { 1, 64, 1000 };
+	const uint32_t n_samples = 16384;
+
+	uint32_t n_outputs = 0;
+	for (uint32_t i = 0; i < plugin->n_ports; i++) {
+		n_outputs += plugin->ports[i].type == TEST_AUDIO_OUT;
+	}
+
+	float* input = (float*)malloc(n_samples * sizeof(float));
+	float* expected[TEST_MAX_OUTPUTS];
+	float* outputs[TEST_MAX_OUTPUTS];
+	test_signal(input, n_samples);
+	for (uint32_t i = 0; i < TEST_MAX_OUTPUTS; i++) {
+		expected[i] = (float*)calloc(n_samples, sizeof(float));
+		outputs[i] = (float*)calloc(n_samples, sizeof(float));
+	}
+
+	for (unsigned l = 0; l < 3; l++) {
+		for (uint32_t in_place = 0; in_place <= n_outputs; in_place++) {
+			TestInstance instance;
+			if (!test_instantiate(&instance, plugin, 48000.0,
+			                      (int32_t)lengths[l])) {
+				TEST_CHECK(0, "%s: failed to instantiate", plugin->uri);
+				continue;
+			}
+			test_apply(&instance, setting);
+			instance.descriptor->activate(instance.handle);
+			test_process(&instance, input, in_place ? outputs : expected,
+			             n_samples, lengths[l], in_place);
+			instance.descriptor->deactivate(instance.handle);
+			test_cleanup(&instance);
+
+			for (uint32_t i = 0; in_place && i < n_outputs; i++) {
+				TEST_CHECK(!memcmp(outputs[i], expected[i],
+				                   n_samples * sizeof(float)),
+				           "%s (%s, blocks of %u): output %u differs with "
+				           "output %u in place",
+				           plugin->uri, setting->name, lengths[l], i,
+				           in_place - 1);
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < TEST_MAX_OUTPUTS; i++) {
+		free(outputs[i]);
+		free(expected[i]);
+	}
+	free(input);
+}
+
+/* ==== Latency ==== */
+
+/**
+   Check that the reported latency of `plugin` with `setting` is the delay of
+   an impulse, that is that the output is silent until the impulse comes out,
+   at various sampling rates and block lengths.
+*/
+static inline void
+check_latency(const TestPlugin* plugin, const TestSetting* setting)
+{
+	static const double   rates[] = { 44100.0, 48000.0, 96000.0 };
+	static const uint32_t lengths[] = { 1, 64, 1000 };
+	const uint32_t n_samples = 4096;
+	const uint32_t impulse = 1500;
+
+	float* input = (float*)calloc(n_samples, sizeof(float));
+	float* outputs[TEST_MAX_OUTPUTS];
+	for (uint32_t i = 0; i < TEST_MAX_OUTPUTS; i++) {
+		outputs[i] = (float*)calloc(n_samples, sizeof(float));
+	}
+	input[impulse] = 1.0f;
+
+	for (unsigned r = 0; r < 3; r++) {
+		for (unsigned l = 0; l < 3; l++) {
+			TestInstance instance;
+			if (!test_instantiate(&instance, plugin, rates[r],
+			                      (int32_t)lengths[l])) {
+				TEST_CHECK(0, "%s: failed to instantiate", plugin->uri);
+				continue;
+			}
+			test_apply(&instance, setting);
+			instance.descriptor->activate(instance.handle);
+			test_process(&instance, input, outputs, n_samples, lengths[l], 0);
+			instance.descriptor->deactivate(instance.handle);
+			test_cleanup(&instance);
+
+			// First sample out of silence, on any output
+			uint32_t first = n_samples;
+			for (uint32_t i = 0; i < TEST_MAX_OUTPUTS; i++) {
+				for (uint32_t j = 0; j < first; j++) {
+					if (outputs[i][j] != 0.0f) {
+						first = j;
+					}
+				}
+			}
+			const float latency = instance.controls[plugin->latency];
+			TEST_CHECK(latency >= 0.0f && latency == floorf(latency) &&
+			           first == impulse + (uint32_t)latency,
+			           "%s (%s, %g Hz, blocks of %u): latency %g, "
+			           "impulse delayed by %d samples",
+			           plugin->uri, setting->name, rates[r], lengths[l],
+			           latency, (int)first - (int)impulse);
+		}
+	}
+
+	for (uint32_t i = 0; i < TEST_MAX_OUTPUTS; i++) {
+		free(outputs[i]);
+	}
+	free(input);
+}
+
+/** Run the checks that apply to any plugin, with each of its settings */
+static inline void
+check_plugin(const TestPlugin* plugin)
+{
+	for (uint32_t i = 0; i < plugin->n_settings; i++) {
+		check_in_place(plugin, &plugin->settings[i]);
+		check_latency(plugin, &plugin->settings[i]);
+	}
+}
+
+#endif // SIMPLE_LV2_TEST_HARNESS_H
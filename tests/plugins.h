@@ -0,0 +1,200 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Ports of every plugin, as described in their Turtle files: index, type,
+   minimum, maximum and default value of control inputs, and whether the port
+   is lv2:connectionOptional.  Keep them in sync with the `.ttl` files.
+
+   Each plugin also has settings going through each of its processing paths,
+   used by the tests and the benchmark.
+*/
+
+#ifndef SIMPLE_LV2_TEST_PLUGINS_H
+#define SIMPLE_LV2_TEST_PLUGINS_H
+
+#include "harness.h"
+
+static const TestPort test_chorus_ports[] = {
+	{  0, TEST_CONTROL_IN,     0.0f,    20.0f,     0.4f, 0 }, // rate
+	{  1, TEST_CONTROL_IN,     0.0f,     1.0f,    0.33f, 0 }, // depth
+	{  2, TEST_CONTROL_IN,     0.0f,     1.0f,     0.5f, 0 }, // mix
+	{  3, TEST_AUDIO_IN,       0.0f,     0.0f,     0.0f, 0 }, // in
+	{  4, TEST_AUDIO_OUT,      0.0f,     0.0f,     0.0f, 0 }, // out
+	{  5, TEST_CONTROL_IN,     0.0f,   360.0f,     0.0f, 0 }, // phase
+	{  6, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // sync
+	{  7, TEST_ATOM_IN,        0.0f,     0.0f,     0.0f, 1 }, // control
+	{  8, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // latency
+	{  9, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // lfo
+	{ 10, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // delay_time
+};
+
+static const TestSetting test_chorus_settings[] = {
+	{ "full", 0, { { 0, 0.0f } } },
+	{ "dry", 1, { { 2, 0.0f } } },
+	{ "synced", 2, { { 6, 1.0f }, { 5, 90.0f } } }
+};
+
+static const TestPlugin test_chorus = {
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#simple-chorus",
+	test_chorus_ports,
+	sizeof(test_chorus_ports) / sizeof(TestPort),
+	8,
+	test_chorus_settings,
+	sizeof(test_chorus_settings) / sizeof(TestSetting)
+};
+
+static const TestPort test_echo_ports[] = {
+	{  0, TEST_CONTROL_IN,     0.0f,     1.0f,     0.5f, 0 }, // time
+	{  1, TEST_CONTROL_IN,     0.0f,     1.0f,     0.5f, 0 }, // feedback
+	{  2, TEST_AUDIO_IN,       0.0f,     0.0f,     0.0f, 0 }, // in
+	{  3, TEST_AUDIO_OUT,      0.0f,     0.0f,     0.0f, 0 }, // out
+	{  4, TEST_CONTROL_IN,   200.0f, 20000.0f, 20000.0f, 0 }, // lowpass
+	{  5, TEST_CONTROL_IN,    20.0f,  2000.0f,    20.0f, 0 }, // highpass
+	{  6, TEST_CONTROL_IN,     0.0f,    10.0f,     0.0f, 0 }, // wow_depth
+	{  7, TEST_CONTROL_IN,    0.05f,    10.0f,     0.5f, 0 }, // wow_rate
+	{  8, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // latency
+	{  9, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // lfo
+	{ 10, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // delay_time
+	{ 11, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // tail
+	{ 12, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // duck
+	{ 13, TEST_CONTROL_IN,     1.0f,   100.0f,    10.0f, 0 }, // duck_attack
+	{ 14, TEST_CONTROL_IN,    10.0f,  2000.0f,   250.0f, 0 }, // duck_release
+	{ 15, TEST_AUDIO_IN,       0.0f,     0.0f,     0.0f, 1 }, // sidechain
+};
+
+static const TestSetting test_echo_settings[] = {
+	{ "full", 0, { { 0, 0.0f } } },
+	{ "no feedback", 1, { { 1, 0.0f } } },
+	{ "tape", 3, { { 4, 2000.0f }, { 5, 300.0f }, { 6, 5.0f } } },
+	{ "ducking", 1, { { 12, 1.0f } } }
+};
+
+static const TestPlugin test_echo = {
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#simple-echo",
+	test_echo_ports,
+	sizeof(test_echo_ports) / sizeof(TestPort),
+	8,
+	test_echo_settings,
+	sizeof(test_echo_settings) / sizeof(TestSetting)
+};
+
+static const TestPort test_multitap_ports[] = {
+	{  0, TEST_CONTROL_IN,     0.0f,     1.0f,     1.0f, 0 }, // dry
+	{  1, TEST_AUDIO_IN,       0.0f,     0.0f,     0.0f, 0 }, // in
+	{  2, TEST_AUDIO_OUT,      0.0f,     0.0f,     0.0f, 0 }, // out_left
+	{  3, TEST_AUDIO_OUT,      0.0f,     0.0f,     0.0f, 0 }, // out_right
+	{  4, TEST_CONTROL_IN,     0.0f,     1.0f,    0.25f, 0 }, // time1
+	{  5, TEST_CONTROL_IN,     0.0f,     1.0f,     0.6f, 0 }, // gain1
+	{  6, TEST_CONTROL_IN,    -1.0f,     1.0f,    -0.5f, 0 }, // pan1
+	{  7, TEST_CONTROL_IN,     0.0f,     1.0f,     0.5f, 0 }, // time2
+	{  8, TEST_CONTROL_IN,     0.0f,     1.0f,    0.45f, 0 }, // gain2
+	{  9, TEST_CONTROL_IN,    -1.0f,     1.0f,     0.5f, 0 }, // pan2
+	{ 10, TEST_CONTROL_IN,     0.0f,     1.0f,    0.75f, 0 }, // time3
+	{ 11, TEST_CONTROL_IN,     0.0f,     1.0f,     0.3f, 0 }, // gain3
+	{ 12, TEST_CONTROL_IN,    -1.0f,     1.0f,   -0.25f, 0 }, // pan3
+	{ 13, TEST_CONTROL_IN,     0.0f,     1.0f,     1.0f, 0 }, // time4
+	{ 14, TEST_CONTROL_IN,     0.0f,     1.0f,     0.2f, 0 }, // gain4
+	{ 15, TEST_CONTROL_IN,    -1.0f,     1.0f,    0.25f, 0 }, // pan4
+	{ 16, TEST_CONTROL_IN,     0.0f,     1.0f,   0.125f, 0 }, // time5
+	{ 17, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // gain5
+	{ 18, TEST_CONTROL_IN,    -1.0f,     1.0f,     0.0f, 0 }, // pan5
+	{ 19, TEST_CONTROL_IN,     0.0f,     1.0f,   0.375f, 0 }, // time6
+	{ 20, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // gain6
+	{ 21, TEST_CONTROL_IN,    -1.0f,     1.0f,     0.0f, 0 }, // pan6
+	{ 22, TEST_CONTROL_IN,     0.0f,     1.0f,   0.625f, 0 }, // time7
+	{ 23, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // gain7
+	{ 24, TEST_CONTROL_IN,    -1.0f,     1.0f,     0.0f, 0 }, // pan7
+	{ 25, TEST_CONTROL_IN,     0.0f,     1.0f,   0.875f, 0 }, // time8
+	{ 26, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // gain8
+	{ 27, TEST_CONTROL_IN,    -1.0f,     1.0f,     0.0f, 0 }, // pan8
+	{ 28, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // latency
+};
+
+static const TestSetting test_multitap_settings[] = {
+	{ "full", 0, { { 0, 0.0f } } },
+	{ "dry", 8, { {  5, 0.0f }, {  8, 0.0f }, { 11, 0.0f }, { 14, 0.0f },
+	              { 17, 0.0f }, { 20, 0.0f }, { 23, 0.0f }, { 26, 0.0f } } }
+};
+
+static const TestPlugin test_multitap = {
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#simple-multitap-echo",
+	test_multitap_ports,
+	sizeof(test_multitap_ports) / sizeof(TestPort),
+	28,
+	test_multitap_settings,
+	sizeof(test_multitap_settings) / sizeof(TestSetting)
+};
+
+static const TestPort test_flanger_ports[] = {
+	{  0, TEST_CONTROL_IN,    0.01f,    20.0f,     0.4f, 0 }, // rate
+	{  1, TEST_CONTROL_IN,     0.0f,     1.0f,    0.33f, 0 }, // depth
+	{  2, TEST_CONTROL_IN,    -1.0f,     1.0f,   -0.75f, 0 }, // feedback
+	{  3, TEST_CONTROL_IN,     0.0f,     1.0f,    0.66f, 0 }, // mix
+	{  4, TEST_AUDIO_IN,       0.0f,     0.0f,     0.0f, 0 }, // in
+	{  5, TEST_AUDIO_OUT,      0.0f,     0.0f,     0.0f, 0 }, // out
+	{  6, TEST_CONTROL_IN,     0.0f,   360.0f,     0.0f, 0 }, // phase
+	{  7, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // sync
+	{  8, TEST_ATOM_IN,        0.0f,     0.0f,     0.0f, 1 }, // control
+	{  9, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // latency
+	{ 10, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // lfo
+	{ 11, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // delay_time
+};
+
+static const TestSetting test_flanger_settings[] = {
+	{ "full", 0, { { 0, 0.0f } } },
+	{ "dry", 2, { { 3, 0.0f }, { 2, 0.0f } } },
+	{ "synced", 2, { { 7, 1.0f }, { 6, 90.0f } } }
+};
+
+static const TestPlugin test_flanger = {
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#simple-flanger",
+	test_flanger_ports,
+	sizeof(test_flanger_ports) / sizeof(TestPort),
+	9,
+	test_flanger_settings,
+	sizeof(test_flanger_settings) / sizeof(TestSetting)
+};
+
+static const TestPort test_tremolo_ports[] = {
+	{  0, TEST_CONTROL_IN,     0.1f,    10.0f,     1.0f, 0 }, // rate
+	{  1, TEST_CONTROL_IN,     0.0f,     1.0f,     0.5f, 0 }, // depth
+	{  2, TEST_AUDIO_IN,       0.0f,     0.0f,     0.0f, 0 }, // in
+	{  3, TEST_AUDIO_OUT,      0.0f,     0.0f,     0.0f, 0 }, // out
+	{  4, TEST_CONTROL_IN,     0.0f,   360.0f,     0.0f, 0 }, // phase
+	{  5, TEST_CONTROL_IN,     0.0f,     1.0f,     0.0f, 0 }, // sync
+	{  6, TEST_ATOM_IN,        0.0f,     0.0f,     0.0f, 1 }, // control
+	{  7, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // latency
+	{  8, TEST_CONTROL_OUT,    0.0f,     0.0f,     0.0f, 0 }, // lfo
+};
+
+static const TestSetting test_tremolo_settings[] = {
+	{ "full", 0, { { 0, 0.0f } } },
+	{ "bypass", 1, { { 1, 0.0f } } },
+	{ "synced", 2, { { 5, 1.0f }, { 4, 90.0f } } }
+};
+
+static const TestPlugin test_tremolo = {
+	"https://github.com/YruamaLairba/yru-simple-LV2-C#simple-tremolo",
+	test_tremolo_ports,
+	sizeof(test_tremolo_ports) / sizeof(TestPort),
+	7,
+	test_tremolo_settings,
+	sizeof(test_tremolo_settings) / sizeof(TestSetting)
+};
+
+#endif // SIMPLE_LV2_TEST_PLUGINS_H
@@ -0,0 +1,32 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Tests of the chorus, with settings going through each processing path.
+*/
+
+#include "../simple-chorus/chorus.c"
+
+#include "harness.h"
+#include "plugins.h"
+
+int
+main(void)
+{
+	check_plugin(&test_chorus);
+	return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Tests of the DSP building blocks shared by all plugins, without a host.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+
+#include "dsp.h"
+#include "lfo_sync.h"
+
+#include "check.h"
+
+/**
+   Run an LFO at `frequency` for an hour at 192 kHz, in chunks of 256 samples
+   like a plugin does, and check that its phase is the one computed from the
+   sample position (as when syncing to the host transport), and that its
+   value doesn't drift from an exact sine.
+*/
+static void
+check_lfo_drift(float frequency)
+{
+	const double   rate = 192000.0;
+	const uint32_t chunk = 256;
+	const int64_t  n_samples = 3600 * 192000;
+	const uint64_t delta = lfo_delta(frequency, rate);
+
+	uint64_t progression = 0;
+	double   max_error = 0.0;
+	for (int64_t frame = 0; frame < n_samples; frame += chunk) {
+		if (progression != lfo_phase_at(frame, delta)) {
+			TEST_CHECK(0, "LFO at %g Hz: phase off by %lld at sample %lld",
+			           frequency,
+			           (long long)(progression - lfo_phase_at(frame, delta)),
+			           (long long)frame);
+			return;
+		}
+
+		// Exact phase, in cycles, at the first and last sample of the chunk
+		for (uint32_t i = 0; i < chunk; i += chunk - 1) {
+			const long double cycles =
+				(long double)(frame + i) * frequency / rate;
+			const double phase = (double)(cycles - floorl(cycles));
+			const double error = fabs(
+				lfo_value(progression, delta, i) -
+				sin(2.0 * M_PI * phase));
+			max_error = error > max_error ? error : max_error;
+		}
+		progression = lfo_advance(progression, delta, chunk);
+	}
+
+	// A float sine of a 24-bit phase is accurate to about 1e-6
+	TEST_CHECK(max_error < 1e-5,
+	           "LFO at %g Hz: value off by %g after an hour",
+	           frequency, max_error);
+}
+
+/**
+   Check that an envelope follower updated with shorter steps, as at the end
+   of a chunk, moves like one updated with full steps over as many samples.
+*/
+static void
+check_envelope_steps(uint32_t n_samples)
+{
+	const float coef = envelope_coef(10.0f, 48000.0f);
+	const float step_coef = envelope_step_coef(coef, n_samples);
+	float full = 0.0f;
+	float partial = 0.0f;
+	for (uint32_t i = 0; i < n_samples * ENVELOPE_STEP * 10; i++) {
+		if (i % ENVELOPE_STEP == 0) {
+			envelope_run(&full, 1.0f, coef, coef);
+		}
+		if (i % n_samples == 0) {
+			envelope_run(&partial, 1.0f, step_coef, step_coef);
+		}
+	}
+	TEST_CHECK(fabsf(full - partial) < 1e-4f,
+	           "envelope in steps of %u samples: %g instead of %g",
+	           n_samples, partial, full);
+}
+
+/**
+   Run an LFO synced to a transport rolling at half speed, in chunks of odd
+   lengths, and check that the phase at each chunk start is where the previous
+   chunk ended, and where the transport position puts it.
+*/
+static void
+check_lfo_sync_speed(void)
+{
+	const uint32_t     chunks[] = { 255, 100, 1, 333 };
+	const uint64_t     delta = lfo_delta(3.0f, 48000.0);
+	const LfoSyncURIDs urids = { 0 };
+
+	LfoSync sync = { 0 };
+	sync.frame = 1000;
+	sync.speed = 0.5f;
+	sync.valid = 1;
+
+	uint64_t end = 0;
+	double   frames = 0.0;
+	for (uint32_t i = 0; i < 40; i++) {
+		const uint32_t n_samples = chunks[i % 4];
+		uint64_t chunk_delta = delta;
+		const uint64_t progression =
+			lfo_sync_phase(&sync, &urids, NULL, 1, 0.0f, 0, &chunk_delta);
+
+		const long double cycles = (1000.0L + frames) * delta /
+			18446744073709551616.0L;
+		const double error = fabs(
+			(double)(int64_t)(progression -
+			                  (uint64_t)((cycles - floorl(cycles)) *
+			                             18446744073709551616.0L)) /
+			18446744073709551616.0);
+		TEST_CHECK(error < 1e-9, "synced LFO off the transport by %g cycles "
+		           "at chunk %u", error, i);
+		if (i > 0) {
+			const double jump = fabs(
+				(double)(int64_t)(progression - end) / 18446744073709551616.0);
+			TEST_CHECK(jump < 1e-9, "synced LFO jumps by %g cycles at chunk %u",
+			           jump, i);
+		}
+
+		end = lfo_advance(progression, chunk_delta, n_samples);
+		lfo_sync_advance(&sync, n_samples);
+		frames += 0.5 * n_samples;
+	}
+}
+
+int
+main(void)
+{
+	static const float frequencies[] = { 0.05f, 0.4f, 7.3f, 20.0f };
+	for (unsigned i = 0; i < TEST_COUNT(frequencies); i++) {
+		check_lfo_drift(frequencies[i]);
+	}
+	for (uint32_t n = 1; n <= ENVELOPE_STEP; n++) {
+		check_envelope_steps(n);
+	}
+	check_lfo_sync_speed();
+	return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
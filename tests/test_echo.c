@@ -0,0 +1,136 @@
+/*
+  Copyright 2017 Amaury ABRIAL <yruama_lairba@hotmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+   Tests of the echo and the multi-tap echo, with settings going through each processing path.
+*/
+
+#include "../simple-echo/echo.c"
+
+#include "harness.h"
+#include "plugins.h"
+
+/**
+   Check that the repeats of the echo die out once its high-pass filter is
+   turned off, with feedback still filtered by the low-pass: the high-pass
+   state left from when it was on mustn't add a DC offset to the repeats.
+*/
+static void
+check_highpass_off(void)
+{
+	const uint32_t n_samples = 48000;
+	float* input = (float*)calloc(n_samples, sizeof(float));
+	float* output = (float*)calloc(n_samples, sizeof(float));
+	float* outputs[TEST_MAX_OUTPUTS] = { output, NULL };
+	TestInstance instance;
+
+	if (!test_instantiate(&instance, &test_echo, 48000.0, 256)) {
+		TEST_CHECK(0, "%s: failed to instantiate", test_echo.uri);
+		free(output);
+		free(input);
+		return;
+	}
+	test_apply(&instance, &test_echo_settings[2]);
+	instance.descriptor->activate(instance.handle);
+	test_signal(input, n_samples);
+	test_process(&instance, input, outputs, n_samples, 256, 0);
+
+	// 10 s of silence, about 20 repeats
+	memset(input, 0, n_samples * sizeof(float));
+	instance.controls[5] = 20.0f;
+	for (unsigned i = 0; i < 10; i++) {
+		test_process(&instance, input, outputs, n_samples, 256, 0);
+	}
+	instance.descriptor->deactivate(instance.handle);
+	test_cleanup(&instance);
+
+	float peak = 0.0f;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		peak = fmaxf(peak, fabsf(output[i]));
+	}
+	TEST_CHECK(peak < 1e-4f,
+	           "%s: repeats at %g after 10 s with the high-pass off",
+	           test_echo.uri, peak);
+
+	free(output);
+	free(input);
+}
+
+/**
+   Check that the meters of the echo follow the path in use: the wow LFO
+   keeps moving, and the delay time is the one of the path.
+*/
+static void
+check_meters(void)
+{
+	static const float settings[][2] = {
+		{ 0.5f, 0.0f }, // full, delay time unmodulated
+		{ 0.0f, 0.0f }, // no feedback
+		{ 0.5f, 4.0f }  // tape, up to 4 ms shorter
+	};
+	const uint32_t n_samples = 4800;
+	float* input = (float*)calloc(n_samples, sizeof(float));
+	float* output = (float*)calloc(n_samples, sizeof(float));
+	float* outputs[TEST_MAX_OUTPUTS] = { output, NULL };
+
+	for (unsigned s = 0; s < 3; s++) {
+		TestInstance instance;
+		if (!test_instantiate(&instance, &test_echo, 48000.0, 256)) {
+			TEST_CHECK(0, "%s: failed to instantiate", test_echo.uri);
+			continue;
+		}
+		instance.controls[0] = 0.25f;
+		instance.controls[1] = settings[s][0];
+		instance.controls[6] = settings[s][1];
+		instance.controls[7] = 7.0f;
+		instance.descriptor->activate(instance.handle);
+
+		float lfo_min = 1.0f;
+		float lfo_max = -1.0f;
+		for (unsigned i = 0; i < 4; i++) {
+			test_process(&instance, input, outputs, n_samples, 256, 0);
+			const float lfo = instance.controls[9];
+			const float delay_time = instance.controls[10];
+			lfo_min = fminf(lfo_min, lfo);
+			lfo_max = fmaxf(lfo_max, lfo);
+			TEST_CHECK(delay_time <= 250.0f &&
+			           delay_time >= 250.0f - settings[s][1] &&
+			           (settings[s][1] > 0.0f || delay_time == 250.0f),
+			           "%s (feedback %g, wow %g ms): delay time %g ms",
+			           test_echo.uri, settings[s][0], settings[s][1],
+			           delay_time);
+		}
+		TEST_CHECK(lfo_max - lfo_min > 0.5f,
+		           "%s (feedback %g, wow %g ms): LFO meter stuck at %g",
+		           test_echo.uri, settings[s][0], settings[s][1], lfo_min);
+		instance.descriptor->deactivate(instance.handle);
+		test_cleanup(&instance);
+	}
+
+	free(output);
+	free(input);
+}
+
+int
+main(void)
+{
+	check_plugin(&test_echo);
+	check_highpass_off();
+	check_meters();
+	check_plugin(&test_multitap);
+	return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}